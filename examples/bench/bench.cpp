@@ -0,0 +1,711 @@
+#include "render/memory_render_device.h"
+#include "render/command_buffer.h"
+#include "render/pixel_format.h"
+#include "render/shader.h"
+#include "transform.h"
+#include "vertex_stream.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace fbrender;
+
+/*
+ * Microbenchmarks of every pipeline stage plus a few whole scenes, printed as
+ * JSON. Every benchmark reports the time per operation and throughputs in the
+ * units that fit it. Rendering goes to a MemoryRenderDevice, so no screen is
+ * needed. An optional argument only runs the benchmarks whose name contains it.
+ */
+
+struct Rate {
+    const char* unit;
+    double value;
+};
+
+struct Result {
+    std::string name;
+    double ns_per_op;
+    std::vector<Rate> rates;
+};
+
+static std::vector<Result> results;
+static const char* filter = nullptr;
+
+static bool selected(const std::string& name)
+{
+    return !filter || name.find(filter) != std::string::npos;
+}
+
+/* nanoseconds per call of op, repeating it for at least 0.2 seconds */
+template <class Op>
+static double measure(Op op)
+{
+    typedef std::chrono::steady_clock clock;
+
+    op();
+    for (long iterations = 1; ; iterations *= 2) {
+        clock::time_point start = clock::now();
+        for (long i = 0; i < iterations; i++) op();
+        double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+        if (ns >= 2e8) return ns / iterations;
+    }
+}
+
+/* items_per_op is counted in millions per second under unit, a second unit is optional */
+static void report(const std::string& name, double ns_per_op, const char* unit, double items_per_op,
+                   const char* unit2 = nullptr, double items2_per_op = 0)
+{
+    Result r = { name, ns_per_op, std::vector<Rate>() };
+    Rate first = { unit, items_per_op * 1e3 / ns_per_op };
+    r.rates.push_back(first);
+    if (unit2) {
+        Rate second = { unit2, items2_per_op * 1e3 / ns_per_op };
+        r.rates.push_back(second);
+    }
+    results.push_back(r);
+
+    fprintf(stderr, "%-44s %12.1f ns/op", name.c_str(), ns_per_op);
+    for (size_t i = 0; i < r.rates.size(); i++) {
+        fprintf(stderr, " %10.4g %s", r.rates[i].value, r.rates[i].unit);
+    }
+    fprintf(stderr, "\n");
+}
+
+/* keeps results alive so the compiler can't drop the work producing them */
+static volatile Real sink;
+
+static const char* simd_name(int level)
+{
+    switch (level) {
+        case SIMD_AVX2: return "avx2";
+        case SIMD_SSE41: return "sse41";
+        default: return "scalar";
+    }
+}
+
+static void bench_present()
+{
+    struct { const char* name; PixelFormat format; } formats[] = {
+        { "xrgb8888", PF_XRGB8888 },
+        { "xbgr8888", PF_XBGR8888 },
+        { "argb8888", PF_ARGB8888 },
+        { "rgb888", PF_RGB888 },
+        { "bgr888", PF_BGR888 },
+        { "rgb565", PF_RGB565 },
+        { "bgr565", PF_BGR565 },
+    };
+
+    /* a 1080p frame, with the destination rows padded like a typical fbdev */
+    const int width = 1920, height = 1080;
+    std::vector<uint32_t> frame(width * height);
+    for (size_t i = 0; i < frame.size(); i++) frame[i] = (uint32_t)(i * 2654435761u);
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+        size_t line_length = width * formats[f].format.bytes_per_pixel + 64;
+        std::vector<unsigned char> screen(line_length * height);
+
+        for (int level = SIMD_NONE; level <= detect_simd_level(); level++) {
+            std::string name = std::string("present/") + formats[f].name + "/" + simd_name(level);
+            if (!selected(name)) continue;
+
+            PixelConverter pc = make_pixel_converter(formats[f].format, level);
+            double ns = measure([&]() {
+                for (int y = 0; y < height; y++) {
+                    pc.convert(&screen[y * line_length], &frame[y * width], width);
+                }
+            });
+            report(name, ns, "Mpix/s", (double)width * height);
+        }
+    }
+}
+
+static void bench_matrix()
+{
+    const int n = 1000;
+    Matrix4 a = Matrix4::rotate(1, 2, 3, (Real)0.3) * Matrix4::translate(1, -2, 3);
+    Matrix4 b = Matrix4::rotate(-2, 1, 1, (Real)0.1);
+
+    if (selected("matrix/multiply")) {
+        double ns = measure([&]() {
+            Matrix4 acc = a;
+            for (int i = 0; i < n; i++) acc = acc * b;
+            sink = acc[0][0];
+        });
+        report("matrix/multiply", ns / n, "Mop/s", 1);
+    }
+
+    if (selected("matrix/inverse")) {
+        double ns = measure([&]() {
+            Real sum = 0;
+            for (int i = 0; i < n; i++) {
+                a[3][0] = (Real)i;
+                sum += a.inverse()[3][0];
+            }
+            sink = sum;
+        });
+        report("matrix/inverse", ns / n, "Mop/s", 1);
+    }
+}
+
+/* points on a unit sphere, the inputs of the vertex benchmarks */
+static const size_t SPHERE_VERTICES = 4096;
+
+static void bench_transform()
+{
+    std::vector<Real> attr[11];
+    for (int k = 0; k < 11; k++) attr[k].resize(SPHERE_VERTICES);
+    std::vector<Vertex> verts;
+    for (size_t i = 0; i < SPHERE_VERTICES; i++) {
+        Real t = (Real)i / SPHERE_VERTICES * (Real)3.1415926, p = (Real)i * (Real)0.618034 * (Real)6.2831853;
+        Real x = std::sin(t) * std::cos(p), y = std::sin(t) * std::sin(p), z = std::cos(t);
+        Real values[11] = { x, y, z, x, y, z, t, p, (Real)0.5, (Real)0.5, (Real)0.5 };
+        for (int k = 0; k < 11; k++) attr[k][i] = values[k];
+        verts.push_back(Vertex(x, y, z, 1, t, p, (Real)0.5, (Real)0.5, (Real)0.5));
+    }
+
+    Transform transform(1280, 720);
+    transform.set_view(Matrix4::lookat(Vector4(4, 0, 0, 1), Vector4(0, 0, 0, 1), Vector4(0, 0, 1, 1)));
+    transform.set_world(Matrix4::rotate(1, 1, 0, (Real)0.5));
+
+    if (selected("transform/vertex")) {
+        double ns = measure([&]() {
+            Real sum = 0;
+            for (size_t i = 0; i < verts.size(); i++) {
+                Vertex v = transform.apply_projection(transform.apply_mv_transform(verts[i]));
+                if (!Transform::check_cvv(v)) sum += transform.homogenize(v).get_pos().x;
+            }
+            sink = sum;
+        });
+        report("transform/vertex", ns, "Mvtx/s", (double)SPHERE_VERTICES);
+    }
+
+    if (selected("transform/stream")) {
+        VertexStream in = { SPHERE_VERTICES, attr[0].data(), attr[1].data(), attr[2].data(),
+                            attr[3].data(), attr[4].data(), attr[5].data(), attr[6].data(),
+                            attr[7].data(), attr[8].data(), attr[9].data(), attr[10].data() };
+        std::vector<Real> outputs[18];
+        for (int k = 0; k < 18; k++) outputs[k].resize(SPHERE_VERTICES);
+        std::vector<unsigned char> clipped(SPHERE_VERTICES);
+        TransformedStream out = { outputs[0].data(), outputs[1].data(), outputs[2].data(),
+                                  outputs[3].data(), outputs[4].data(), outputs[5].data(),
+                                  outputs[6].data(), outputs[7].data(), outputs[8].data(),
+                                  outputs[9].data(), outputs[10].data(), outputs[11].data(),
+                                  outputs[12].data(), outputs[13].data(), outputs[14].data(),
+                                  outputs[15].data(), outputs[16].data(), outputs[17].data(),
+                                  clipped.data() };
+        double ns = measure([&]() {
+            transform.transform_stream(in, out);
+            sink = outputs[3][0];
+        });
+        report("transform/stream", ns, "Mvtx/s", (double)SPHERE_VERTICES);
+    }
+}
+
+/* the size rendering benchmarks run at */
+static const int SCREEN_WIDTH = 1280;
+static const int SCREEN_HEIGHT = 720;
+
+/* a headless device that maps x and y straight to pixels */
+struct BenchDevice {
+    std::vector<uint32_t> pixels;
+    MemoryRenderDevice device;
+    std::vector<uint32_t> texture;
+
+    BenchDevice()
+        : pixels(SCREEN_WIDTH * SCREEN_HEIGHT),
+          device(SCREEN_WIDTH, SCREEN_HEIGHT, pixels.data(), SCREEN_WIDTH * sizeof(uint32_t))
+    {
+        Matrix4 screen = Matrix4::IDENTITY;
+        screen[0][0] = (Real)2 / SCREEN_WIDTH;
+        screen[3][0] = -1;
+        screen[1][1] = (Real)-2 / SCREEN_HEIGHT;
+        screen[3][1] = 1;
+        device.set_projection(screen);
+        device.set_light_pos(Vector4(SCREEN_WIDTH / 2, SCREEN_HEIGHT / 2, -100, 1));
+        device.clear_color(Color(1, 0, 1));
+
+        texture.resize(256 * 256);
+        for (int y = 0; y < 256; y++) {
+            for (int x = 0; x < 256; x++) texture[y * 256 + x] = ((x / 32 + y / 32) & 1) ? 0xff4020 : 0x20ff40;
+        }
+        device.texture_image_2d(256, 256, RenderDevice::CF_RGBA, texture.data());
+    }
+
+    /* pixels that differ from the magenta clear color, which no benchmark draws */
+    long covered() const
+    {
+        long n = 0;
+        for (size_t i = 0; i < pixels.size(); i++) n += (pixels[i] & 0xffffff) != 0xff00ff;
+        return n;
+    }
+};
+
+/* a grid of cell x cell squares, each split into two triangles of the given
+ * size; triangles smaller than the cell leave the rest of it empty */
+struct TriangleGrid {
+    std::vector<Vertex> verts;
+    std::vector<uint32_t> indices;
+
+    TriangleGrid(int cell, Real size)
+    {
+        for (int y = 0; y + cell <= SCREEN_HEIGHT; y += cell) {
+            for (int x = 0; x + cell <= SCREEN_WIDTH; x += cell) {
+                uint32_t base = (uint32_t)verts.size();
+                Real x0 = (Real)x, y0 = (Real)y, x1 = x0 + size, y1 = y0 + size;
+                verts.push_back(Vertex(x0, y0, (Real)0.5, 1, 0, 0, 1, (Real)0.2, (Real)0.2));
+                verts.push_back(Vertex(x1, y0, (Real)0.5, 1, 1, 0, (Real)0.2, 1, (Real)0.2));
+                verts.push_back(Vertex(x1, y1, (Real)0.5, 1, 1, 1, (Real)0.2, (Real)0.2, 1));
+                verts.push_back(Vertex(x0, y1, (Real)0.5, 1, 0, 1, 1, 1, (Real)0.2));
+                uint32_t quad[6] = { 0, 1, 2, 0, 2, 3 };
+                for (int k = 0; k < 6; k++) indices.push_back(base + quad[k]);
+            }
+        }
+    }
+
+    size_t triangles() const { return indices.size() / 3; }
+};
+
+static const char* raster_name(int mode)
+{
+    return mode == RenderDevice::RM_HALF_SPACE ? "halfspace" : "scanline";
+}
+
+/* one frame of the grid without presenting it */
+static double draw_grid(BenchDevice& bench, const TriangleGrid& grid)
+{
+    RenderDevice& d = bench.device;
+    return measure([&]() {
+        d.clear();
+        d.draw_indexed(grid.verts.data(), grid.verts.size(), grid.indices.data(), grid.indices.size());
+        d.flush();
+    });
+}
+
+static void bench_setup()
+{
+    /* triangles that cover next to no pixels, so the cost is per triangle */
+    BenchDevice bench;
+    TriangleGrid grid(4, 1);
+    bench.device.enable(RenderDevice::DS_COLOR);
+
+    const int modes[] = { RenderDevice::RM_SCANLINE, RenderDevice::RM_HALF_SPACE };
+    for (int m = 0; m < 2; m++) {
+        std::string name = std::string("setup/") + raster_name(modes[m]);
+        if (!selected(name)) continue;
+
+        bench.device.set_raster_mode(modes[m]);
+        double ns = draw_grid(bench, grid);
+        report(name, ns, "Mtri/s", (double)grid.triangles());
+    }
+}
+
+static void bench_fill()
+{
+    struct { const char* name; int cell; } sizes[] = {
+        { "small", 8 },
+        { "medium", 32 },
+        { "large", 240 },
+    };
+    struct { const char* name; int state; int filter; } states[] = {
+        { "wireframe", RenderDevice::DS_WIREFRAME, RenderDevice::TF_NEAREST },
+        { "color", RenderDevice::DS_COLOR, RenderDevice::TF_NEAREST },
+        { "color_lighting", RenderDevice::DS_COLOR | RenderDevice::DS_LIGHTING, RenderDevice::TF_NEAREST },
+        { "texture", RenderDevice::DS_TEXTURE_2D, RenderDevice::TF_NEAREST },
+        { "texture_lighting", RenderDevice::DS_TEXTURE_2D | RenderDevice::DS_LIGHTING, RenderDevice::TF_NEAREST },
+        { "color_gouraud", RenderDevice::DS_COLOR | RenderDevice::DS_LIGHTING_GOURAUD, RenderDevice::TF_NEAREST },
+        { "texture_gouraud", RenderDevice::DS_TEXTURE_2D | RenderDevice::DS_LIGHTING_GOURAUD, RenderDevice::TF_NEAREST },
+        { "texture_bilinear", RenderDevice::DS_TEXTURE_2D, RenderDevice::TF_LINEAR },
+        { "texture_mipmap", RenderDevice::DS_TEXTURE_2D, RenderDevice::TF_NEAREST_MIPMAP_NEAREST },
+        { "texture_trilinear", RenderDevice::DS_TEXTURE_2D, RenderDevice::TF_LINEAR_MIPMAP_LINEAR },
+    };
+    const int modes[] = { RenderDevice::RM_SCANLINE, RenderDevice::RM_HALF_SPACE };
+    const int all_states = RenderDevice::DS_WIREFRAME | RenderDevice::DS_COLOR | RenderDevice::DS_LIGHTING |
+                           RenderDevice::DS_TEXTURE_2D | RenderDevice::DS_LIGHTING_GOURAUD;
+
+    BenchDevice bench;
+    RenderDevice& d = bench.device;
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        TriangleGrid grid(sizes[s].cell, (Real)sizes[s].cell);
+
+        for (size_t k = 0; k < sizeof(states) / sizeof(states[0]); k++) {
+            for (int m = 0; m < 4; m++) {
+                /* the fixed-point color path only covers filled, point-sampled pixels */
+                bool fixed = m >= 2;
+                if (fixed && (states[k].state == RenderDevice::DS_WIREFRAME ||
+                              states[k].filter != RenderDevice::TF_NEAREST)) continue;
+
+                std::string name = std::string("fill/") + sizes[s].name + "/" + states[k].name + "/" +
+                                   raster_name(modes[m % 2]) + (fixed ? "/fixed" : "");
+                if (!selected(name)) continue;
+
+                d.disable(all_states);
+                d.enable(states[k].state);
+                d.set_texture_filter(states[k].filter);
+                d.set_raster_mode(modes[m % 2]);
+                d.set_color_path(fixed ? RenderDevice::CP_FIXED : RenderDevice::CP_FLOAT);
+
+                /* pixels actually written, counted on a presented frame */
+                d.clear();
+                d.draw_indexed(grid.verts.data(), grid.verts.size(), grid.indices.data(), grid.indices.size());
+                d.swap_buffers();
+                long pixels = bench.covered();
+
+                double ns = draw_grid(bench, grid);
+                report(name, ns, "Mtri/s", (double)grid.triangles(), "Mpix/s", (double)pixels);
+            }
+        }
+    }
+}
+
+/* the built-in shaders on the fill grid, to set against fill/<size>/<state>/halfspace */
+template <class Shader>
+static void bench_shader_fill(BenchDevice& bench, const TriangleGrid& grid, const std::string& name)
+{
+    if (!selected(name)) return;
+
+    RenderDevice& d = bench.device;
+    Shader shader(d.shader_uniforms());
+
+    d.clear();
+    d.draw_shaded(shader, grid.verts.data(), grid.verts.size(), grid.indices.data(), grid.indices.size());
+    d.swap_buffers();
+    long pixels = bench.covered();
+
+    double ns = measure([&]() {
+        d.clear();
+        d.draw_shaded(shader, grid.verts.data(), grid.verts.size(), grid.indices.data(), grid.indices.size());
+        d.flush();
+    });
+    report(name, ns, "Mtri/s", (double)grid.triangles(), "Mpix/s", (double)pixels);
+}
+
+static void bench_shader()
+{
+    struct { const char* name; int cell; } sizes[] = {
+        { "small", 8 },
+        { "medium", 32 },
+        { "large", 240 },
+    };
+
+    BenchDevice bench;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        TriangleGrid grid(sizes[s].cell, (Real)sizes[s].cell);
+        std::string prefix = std::string("shader/") + sizes[s].name + "/";
+
+        bench_shader_fill<ColorShader>(bench, grid, prefix + "color");
+        bench_shader_fill<LitColorShader>(bench, grid, prefix + "color_lighting");
+        bench_shader_fill<TextureShader>(bench, grid, prefix + "texture");
+        bench_shader_fill<LitTextureShader>(bench, grid, prefix + "texture_lighting");
+        bench_shader_fill<GouraudColorShader>(bench, grid, prefix + "color_gouraud");
+        bench_shader_fill<GouraudTextureShader>(bench, grid, prefix + "texture_gouraud");
+    }
+}
+
+static void bench_shade()
+{
+    struct { const char* name; int state; } states[] = {
+        { "color", RenderDevice::DS_COLOR },
+        { "color_lighting", RenderDevice::DS_COLOR | RenderDevice::DS_LIGHTING },
+        { "texture", RenderDevice::DS_TEXTURE_2D },
+        { "texture_lighting", RenderDevice::DS_TEXTURE_2D | RenderDevice::DS_LIGHTING },
+        { "texture_gouraud", RenderDevice::DS_TEXTURE_2D | RenderDevice::DS_LIGHTING_GOURAUD },
+    };
+    struct { const char* name; int path; } paths[] = {
+        { "float", RenderDevice::CP_FLOAT },
+        { "fixed", RenderDevice::CP_FIXED },
+    };
+
+    std::vector<uint32_t> texels(256 * 256);
+    for (size_t i = 0; i < texels.size(); i++) texels[i] = (uint32_t)(i * 2654435761u);
+    Texture texture = {};
+    texture.width = texture.height = 256;
+    texture.level_count = 1;
+    texture.levels[0] = texels.data();
+
+    ShadingState st = {};
+    st.texture = &texture;
+    st.tex_filter = RenderDevice::TF_NEAREST;
+    st.light_world_pos = Vector4(0, 0, -10);
+    st.ambient_color = Color((Real)0.2, (Real)0.2, (Real)0.2);
+    st.diffuse_color = Color((Real)0.5, (Real)0.5, (Real)0.5);
+    st.material_diffuse = Color((Real)0.3, (Real)0.3, (Real)0.3);
+
+    /* one full segment of a tile row, every pixel passes */
+    const int n = RenderDevice::TILE_SIZE;
+    Real start[ATTR_COUNT] = { 1, (Real)0.1, (Real)0.2, (Real)0.1, (Real)0.5, (Real)0.9, 1, 2, 3, 0, 0, 1 };
+    Real step[ATTR_COUNT] = { 0, (Real)0.01, (Real)0.001, (Real)0.01, (Real)-0.005, (Real)-0.01, (Real)0.1, 0, 0, (Real)0.01, 0, 0 };
+    std::vector<uint32_t> color(n);
+    std::vector<Real> depth(n);
+    SpanSegment seg = { color.data(), depth.data(), 0, n, start, step, false, 0, 0 };
+
+    for (size_t k = 0; k < sizeof(states) / sizeof(states[0]); k++) {
+        for (int level = SIMD_NONE; level <= detect_simd_level(); level++) {
+            for (size_t p = 0; p < sizeof(paths) / sizeof(paths[0]); p++) {
+                std::string name = std::string("shade/") + states[k].name + "/" + simd_name(level) + "/" + paths[p].name;
+                if (!selected(name)) continue;
+
+                st.drawing_state = states[k].state;
+                ShadeKernel kernel = select_shade_kernel(level, paths[p].path, shade_features(st));
+                double ns = measure([&]() { kernel(seg, st); });
+                report(name, ns, "Mpix/s", n);
+            }
+        }
+    }
+}
+
+static void bench_texture()
+{
+    BenchDevice bench;
+    RenderDevice& d = bench.device;
+    const double texels = (double)bench.texture.size();
+
+    if (selected("texture/upload")) {
+        /* converting the pixels and building the mip chain */
+        double ns = measure([&]() { d.texture_image_2d(256, 256, RenderDevice::CF_RGBA, bench.texture.data()); });
+        report("texture/upload", ns, "Mtexel/s", texels);
+    }
+
+    if (selected("texture/bind")) {
+        /* switching between two uploaded textures */
+        int names[2];
+        for (int i = 0; i < 2; i++) {
+            names[i] = d.create_texture();
+            d.bind_texture(names[i]);
+            d.texture_image_2d(256, 256, RenderDevice::CF_RGBA, bench.texture.data());
+        }
+
+        int frame = 0;
+        double ns = measure([&]() { d.bind_texture(names[frame++ & 1]); });
+        report("texture/bind", ns, "Mbind/s", 1);
+
+        d.bind_texture(0);
+        for (int i = 0; i < 2; i++) d.delete_texture(names[i]);
+    }
+}
+
+static void bench_clear()
+{
+    BenchDevice bench;
+    RenderDevice& d = bench.device;
+    const double screen = (double)SCREEN_WIDTH * SCREEN_HEIGHT;
+
+    if (selected("clear/lazy")) {
+        /* clear() only marks tiles */
+        double ns = measure([&]() { d.clear(); });
+        report("clear/lazy", ns, "Mpix/s", screen);
+    }
+
+    if (selected("clear/present")) {
+        /* a different color every frame, so every tile is filled on present */
+        int frame = 0;
+        double ns = measure([&]() {
+            d.clear_color(Color((Real)(frame++ & 1), 0, 0));
+            d.clear();
+            d.swap_buffers();
+        });
+        report("clear/present", ns, "Mpix/s", screen);
+    }
+
+    if (selected("clear/draw")) {
+        /* a pixel in every tile writes the clear color to the whole render target */
+        double ns = measure([&]() {
+            d.clear();
+            for (int y = 0; y < SCREEN_HEIGHT; y += RenderDevice::TILE_SIZE) {
+                for (int x = 0; x < SCREEN_WIDTH; x += RenderDevice::TILE_SIZE) d.draw_pixel(x, y, 0xffffff);
+            }
+            d.flush();
+        });
+        report("clear/draw", ns, "Mpix/s", screen);
+    }
+}
+
+static void bench_swap()
+{
+    BenchDevice bench;
+    RenderDevice& d = bench.device;
+    const double screen = (double)SCREEN_WIDTH * SCREEN_HEIGHT;
+
+    if (selected("swap/copy")) {
+        /* every tile changes every frame and is copied to the output */
+        uint32_t color = 0;
+        double ns = measure([&]() {
+            color ^= 0xffffff;
+            for (int y = 0; y < SCREEN_HEIGHT; y += RenderDevice::TILE_SIZE) {
+                for (int x = 0; x < SCREEN_WIDTH; x += RenderDevice::TILE_SIZE) d.draw_pixel(x, y, color);
+            }
+            d.swap_buffers();
+        });
+        report("swap/copy", ns, "Mpix/s", screen);
+    }
+
+    if (selected("swap/unchanged")) {
+        /* nothing drawn, dirty tracking leaves the output alone */
+        for (int i = 0; i < 2; i++) {
+            d.clear();
+            d.swap_buffers();
+        }
+        double ns = measure([&]() { d.swap_buffers(); });
+        report("swap/unchanged", ns, "Mpix/s", screen);
+    }
+}
+
+static const Vertex CUBE_VERTICES[] = {
+    {  1, -1,  1, 1, 0, 0, 1.0f, 0.2f, 0.2f },
+    { -1, -1,  1, 1, 0, 1, 0.2f, 1.0f, 0.2f },
+    { -1,  1,  1, 1, 1, 1, 0.2f, 0.2f, 1.0f },
+    {  1,  1,  1, 1, 1, 0, 1.0f, 0.2f, 1.0f },
+    {  1, -1, -1, 1, 0, 0, 1.0f, 1.0f, 0.2f },
+    { -1, -1, -1, 1, 0, 1, 0.2f, 1.0f, 1.0f },
+    { -1,  1, -1, 1, 1, 1, 1.0f, 0.3f, 0.3f },
+    {  1,  1, -1, 1, 1, 0, 0.2f, 1.0f, 0.3f },
+};
+
+static const uint32_t CUBE_INDICES[] = {
+    0, 1, 2, 2, 3, 0,
+    7, 6, 5, 5, 4, 7,
+    0, 4, 5, 5, 1, 0,
+    1, 5, 6, 6, 2, 1,
+    2, 6, 7, 7, 3, 2,
+    3, 7, 4, 4, 0, 3,
+};
+
+static void bench_scene()
+{
+    struct { const char* name; int threads; } configs[] = {
+        { "scene/cubes", 0 },
+        { "scene/cubes/threaded", (int)std::thread::hardware_concurrency() },
+    };
+
+    for (size_t c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+        if (!selected(configs[c].name)) continue;
+
+        /* a 8x8 wall of textured, lit and rotating cubes in perspective */
+        std::vector<uint32_t> pixels(SCREEN_WIDTH * SCREEN_HEIGHT);
+        MemoryRenderDevice d(SCREEN_WIDTH, SCREEN_HEIGHT, pixels.data(), SCREEN_WIDTH * sizeof(uint32_t));
+        std::vector<uint32_t> texture(256 * 256);
+        for (size_t i = 0; i < texture.size(); i++) texture[i] = (((i % 256) / 32 + i / 8192) & 1) ? 0xffffff : 0x4060ff;
+        d.texture_image_2d(256, 256, RenderDevice::CF_RGBA, texture.data());
+        d.set_camera(Vector4(20, 0, 0, 1), Vector4(0, 0, 0, 1), Vector4(0, 0, 1, 1));
+        d.set_light_pos(Vector4(100, -300, 500, 1));
+        d.clear_color(Color((Real)0.2, (Real)0.2, (Real)0.3));
+        d.enable(RenderDevice::DS_TEXTURE_2D | RenderDevice::DS_LIGHTING);
+        d.set_raster_mode(RenderDevice::RM_HALF_SPACE);
+        d.set_worker_threads(configs[c].threads);
+
+        Real theta = 0;
+        double ns = measure([&]() {
+            d.clear();
+            for (int i = 0; i < 64; i++) {
+                d.set_world(Matrix4::rotate(-1, -0.5, 1, theta + i) *
+                            Matrix4::translate(0, (Real)(i % 8) * 3 - 10.5, (Real)(i / 8) * 3 - 10.5));
+                d.draw_indexed(CUBE_VERTICES, 8, CUBE_INDICES, 36);
+            }
+            d.swap_buffers();
+            theta += (Real)0.01;
+        });
+        report(configs[c].name, ns, "Mtri/s", 64.0 * 12);
+    }
+}
+
+static void bench_commands()
+{
+    struct { const char* name; int mode; } modes[] = {
+        { "commands/immediate", 0 },
+        { "commands/recorded", 1 },
+        { "commands/replayed", 2 },
+    };
+
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        if (!selected(modes[m].name)) continue;
+
+        /* a static row of overlapping cubes in two textures, drawn back to front
+         * and alternating textures, the worst order for the depth test */
+        std::vector<uint32_t> pixels(SCREEN_WIDTH * SCREEN_HEIGHT);
+        MemoryRenderDevice d(SCREEN_WIDTH, SCREEN_HEIGHT, pixels.data(), SCREEN_WIDTH * sizeof(uint32_t));
+        std::vector<uint32_t> texture(256 * 256);
+        int names[2];
+        for (int t = 0; t < 2; t++) {
+            for (size_t i = 0; i < texture.size(); i++) texture[i] = (((i % 256) / 32 + i / 8192 + t) & 1) ? 0xffffff : 0x4060ff;
+            names[t] = d.create_texture();
+            d.bind_texture(names[t]);
+            d.texture_image_2d(256, 256, RenderDevice::CF_RGBA, texture.data());
+        }
+        d.set_camera(Vector4(20, 0, 0, 1), Vector4(0, 0, 0, 1), Vector4(0, 0, 1, 1));
+        d.set_light_pos(Vector4(100, -300, 500, 1));
+        d.set_raster_mode(RenderDevice::RM_HALF_SPACE);
+
+        std::vector<Matrix4> worlds;
+        for (int i = 0; i < 64; i++) {
+            worlds.push_back(Matrix4::rotate(1, (Real)0.3, (Real)0.2, (Real)i * (Real)0.4) *
+                             Matrix4::translate((Real)i * (Real)0.25 - 10, (Real)(i % 5) - 2, (Real)(i / 5 % 3) - 1));
+        }
+
+        CommandBuffer commands;
+        auto record = [&]() {
+            commands.reset();
+            commands.enable(RenderDevice::DS_TEXTURE_2D | RenderDevice::DS_LIGHTING);
+            for (int i = 0; i < 64; i++) {
+                commands.set_world(worlds[i]);
+                commands.bind_texture(names[i % 2]);
+                commands.draw_indexed(CUBE_VERTICES, 8, CUBE_INDICES, 36);
+            }
+        };
+        record();
+
+        double ns = measure([&]() {
+            d.clear();
+            if (modes[m].mode == 0) {
+                d.enable(RenderDevice::DS_TEXTURE_2D | RenderDevice::DS_LIGHTING);
+                for (int i = 0; i < 64; i++) {
+                    d.set_world(worlds[i]);
+                    d.bind_texture(names[i % 2]);
+                    d.draw_indexed(CUBE_VERTICES, 8, CUBE_INDICES, 36);
+                }
+            } else {
+                if (modes[m].mode == 1) record();
+                d.execute(commands);
+            }
+            d.swap_buffers();
+        });
+        report(modes[m].name, ns, "Mtri/s", 64.0 * 12);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) filter = argv[1];
+
+    bench_matrix();
+    bench_transform();
+    bench_setup();
+    bench_fill();
+    bench_shader();
+    bench_shade();
+    bench_texture();
+    bench_clear();
+    bench_swap();
+    bench_present();
+    bench_scene();
+    bench_commands();
+
+    printf("{\n  \"simd\": \"%s\",\n  \"benchmarks\": [\n", simd_name(detect_simd_level()));
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        printf("    { \"name\": \"%s\", \"ns_per_op\": %.1f", r.name.c_str(), r.ns_per_op);
+        for (size_t k = 0; k < r.rates.size(); k++) {
+            printf(", \"%s\": %.6g", r.rates[k].unit, r.rates[k].value);
+        }
+        printf(" }%s\n", i + 1 < results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+
+    return 0;
+}
@@ -16,27 +16,24 @@ Vertex mesh[] = {
 	{   1,  1, -1, 1, 1, 0, 0.2f, 1.0f, 0.3f  }, 
 };
 
-void draw_plane(RenderDevice* device, int a, int b, int c, int d)
-{
-    Vertex v1 = mesh[a], v2 = mesh[b], v3 = mesh[c], v4 = mesh[d];
-    device->draw_triangle(v1, v2, v3);
-    device->draw_triangle(v3, v4, v1);
-} 
+uint32_t indices[] = {
+    0, 1, 2, 2, 3, 0,
+    7, 6, 5, 5, 4, 7,
+    0, 4, 5, 5, 1, 0,
+    1, 5, 6, 6, 2, 1,
+    2, 6, 7, 7, 3, 2,
+    3, 7, 4, 4, 0, 3,
+};
 
 void draw_box(RenderDevice* device, Real theta)
 {
     device->set_world(Matrix4::rotate(-1, -0.5, 1, theta));
-	draw_plane(device, 0, 1, 2, 3);
-	draw_plane(device, 7, 6, 5, 4);
-	draw_plane(device, 0, 4, 5, 1);
-	draw_plane(device, 1, 5, 6, 2);
-	draw_plane(device, 2, 6, 7, 3);
-	draw_plane(device, 3, 7, 4, 0);
+    device->draw_indexed(mesh, sizeof(mesh) / sizeof(mesh[0]), indices, sizeof(indices) / sizeof(indices[0]));
 }
 
 int main()
 {
-    fbrender::RenderDevice* device = new fbrender::FBRenderDevice("/dev/fb0");
+    fbrender::RenderDevice* device = new fbrender::FBRenderDevice("/dev/fb0", fbrender::FBRenderDevice::PM_FLIP);
     device->set_camera({4, 0, 0, 1}, {0, 0, 0, 1}, {0, 0, 1, 1});
     device->enable(RenderDevice::DS_COLOR);
     device->enable(RenderDevice::DS_LIGHTING);
@@ -0,0 +1,103 @@
+#ifndef _COMMAND_BUFFER_H_
+#define _COMMAND_BUFFER_H_
+
+#include "matrix4.h"
+#include "vertex.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace fbrender {
+
+    /*
+     * Draws recorded together with the state they are drawn in, for
+     * RenderDevice::execute(). Recording starts from the state of a new device:
+     * nothing enabled, texture 0 with TF_NEAREST, the default material and an
+     * identity world. The camera, projection and lights are not recorded, they
+     * are the device's when the buffer is executed.
+     *
+     * Execution draws the filled draws grouped by state and, within a state,
+     * front to back by the depth of their bounds, so that the depth test rejects
+     * hidden pixels early. Draws with DS_WIREFRAME write no depth, so they keep
+     * their place and only the filled draws between two of them are reordered.
+     * The order is kept, and the buffer can be executed again every frame
+     * without sorting it anew until something is recorded or the camera moves.
+     *
+     * Draws reference the vertices and indices they are given, which have to
+     * stay alive as long as the buffer is executed.
+     */
+    class CommandBuffer {
+    public:
+        CommandBuffer();
+
+        /* forget everything recorded and return to the initial state */
+        void reset();
+
+        void set_world(const Matrix4& mat);
+        void enable(int state);
+        void disable(int state);
+        void bind_texture(int name);
+        void set_texture_filter(int filter);
+
+        void set_material_ambient(const Color& amb);
+        void set_material_diffuse(const Color& diff);
+        void set_material_specular(const Color& spec);
+        void set_material_emission(const Color& emi);
+        void set_shininess(Real shi);
+
+        void draw_indexed(const Vertex* verts, size_t nverts, const uint32_t* indices, size_t nidx);
+
+        size_t draw_count() const { return draws.size(); }
+
+    private:
+        friend class RenderDevice;
+
+        struct StateBlock {
+            int drawing_state;
+            int texture;
+            int tex_filter;
+            Color material_ambient;
+            Color material_diffuse;
+            Color material_specular;
+            Color material_emission;
+            Real material_shininess;
+
+            bool operator==(const StateBlock& s) const;
+        };
+
+        struct Draw {
+            /* indices into states and worlds */
+            uint32_t state;
+            uint32_t world;
+            const Vertex* verts;
+            size_t nverts;
+            const uint32_t* indices;
+            size_t nidx;
+            /* center of the object-space bounding box of the vertices */
+            Vector4 center;
+        };
+
+        /* state changes since the last draw */
+        StateBlock current;
+        Matrix4 current_world;
+        bool state_changed;
+        bool world_changed;
+
+        /* the states and worlds of the draws, stored again only where they change between draws */
+        std::vector<StateBlock> states;
+        std::vector<Matrix4> worlds;
+        std::vector<Draw> draws;
+
+        /* execution order and the view-projection it was sorted for */
+        std::vector<uint32_t> order;
+        Matrix4 sorted_view_projection;
+        bool sorted;
+
+        /* the order states are grouped in, the costliest switches (texture, then kernel) first */
+        static bool state_less(const StateBlock& a, const StateBlock& b);
+        void sort(const Matrix4& view_projection);
+    };
+}
+
+#endif
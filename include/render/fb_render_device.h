@@ -2,20 +2,56 @@
 #define _FB_RENDER_DEVICE_H_
 
 #include "render/render_device.h"
+#include "render/pixel_format.h"
+
+#include <vector>
+#include <linux/fb.h>
 
 namespace fbrender {
 
     class FBRenderDevice : public RenderDevice {
     public:
-        FBRenderDevice(const char* filename);
+        /* present modes: copy every frame into the visible screen, or render into
+         * an off-screen page and pan to it. PM_FLIP falls back to PM_COPY when
+         * the driver can't provide a second page */
+        static const int PM_COPY = 0x1;
+        static const int PM_FLIP = 0x2;
+
+        FBRenderDevice(const char* filename, int mode = PM_COPY);
         ~FBRenderDevice();
 
+        int get_present_mode() const { return flipping ? PM_FLIP : PM_COPY; }
+        /* wait for vertical blank after flipping, ignored if unsupported */
+        void set_vsync(bool enable) { vsync = enable; }
+
     private:
         int fptr;
         char* fbp;
         long screensize;
+        /* the page on display within fbp, where frames are copied */
+        char* screen;
+
+        struct fb_var_screeninfo vinfo;
+        struct fb_var_screeninfo saved_vinfo;
+        size_t line_length;
+        /* frames are converted to the screen's format when copied */
+        PixelConverter converter;
+        std::vector<uint32_t> fill_row;
+        std::vector<unsigned char> fill_bytes;
+        bool flipping;
+        /* the virtual screen holds two pages and has to be restored */
+        bool paged;
+        /* the driver stopped panning, rendering returns to the internal buffers */
+        bool pan_lost;
+        bool vsync;
+
+        bool enable_flipping(const struct fb_fix_screeninfo& finfo);
 
-        virtual void copy_buffer(const void* buffer, size_t size);
+        virtual void copy_buffer(const void* buffer, size_t pitch);
+        virtual bool partial_present() const { return !flipping; }
+        virtual void copy_rect(const void* buffer, size_t pitch, int x, int y, int w, int h);
+        virtual void fill_rect(int x, int y, int w, int h, uint32_t color);
+        virtual void frame_swapped();
     };
 }
 
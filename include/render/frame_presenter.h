@@ -0,0 +1,63 @@
+#ifndef _FRAME_PRESENTER_H_
+#define _FRAME_PRESENTER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace fbrender {
+
+    /*
+     * A thread that presents finished frames while the caller renders the next.
+     * Frames are buffer numbers handed over through a single pending slot, and
+     * buffers come back through a bitmask of free ones; both are plain atomics,
+     * the lock and condition variable only put either side to sleep.
+     */
+    class FramePresenter {
+    public:
+        /* never blocks: a frame still pending is replaced and counted as dropped */
+        static const int FP_MAILBOX = 0x1;
+        /* blocks submit() while a frame is pending, no frame is ever dropped */
+        static const int FP_QUEUE = 0x2;
+
+        /* buffers [0, nbuffers) except the one being rendered are free, nbuffers is
+         * at least 3 so that the caller never waits for a present in progress */
+        FramePresenter(int nbuffers, int rendering, int policy, const std::function<void(int)>& present);
+        /* presents the pending frame, if any, before returning */
+        ~FramePresenter();
+
+        /* hand over the buffer just rendered, returns the buffer to render next */
+        int submit(int buffer);
+
+        /* wait until every submitted frame has been presented or dropped */
+        void drain();
+
+        unsigned long frames_queued() const { return queued; }
+        unsigned long frames_presented() const { return presented; }
+        unsigned long frames_dropped() const { return dropped; }
+
+    private:
+        std::function<void(int)> present;
+        int policy;
+
+        std::atomic<int> pending;
+        std::atomic<unsigned> free_mask;
+        std::atomic<unsigned long> queued;
+        std::atomic<unsigned long> presented;
+        std::atomic<unsigned long> dropped;
+
+        std::thread thread;
+        std::mutex lock;
+        std::condition_variable cond;
+        bool busy;
+        bool stopping;
+
+        int take_free();
+        void wake();
+        void presenter_main();
+    };
+}
+
+#endif
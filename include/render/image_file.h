@@ -0,0 +1,24 @@
+#ifndef _IMAGE_FILE_H_
+#define _IMAGE_FILE_H_
+
+#include "render/pixel_format.h"
+
+#include <cstddef>
+#include <string>
+
+namespace fbrender {
+
+    /* binary netpbm images: PPM (P6, RGB) and PAM (P7, RGB_ALPHA with opaque alpha) */
+    static const int IF_PPM = 0x1;
+    static const int IF_PAM = 0x2;
+
+    /* header of an image of the given type, the pixel data follows right after it */
+    std::string image_header(int type, int width, int height);
+    /* the pixel layout of the image type, as a PixelConverter destination */
+    PixelFormat image_format(int type);
+
+    /* write PF_XRGB8888 pixels, rows pitch bytes apart, as an image file */
+    bool write_image(const char* filename, int type, const uint32_t* pixels, int width, int height, size_t pitch);
+}
+
+#endif
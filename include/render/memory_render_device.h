@@ -0,0 +1,44 @@
+#ifndef _MEMORY_RENDER_DEVICE_H_
+#define _MEMORY_RENDER_DEVICE_H_
+
+#include "render/render_device.h"
+#include "render/pixel_format.h"
+
+#include <vector>
+
+namespace fbrender {
+
+    /* a headless device that presents into memory instead of a screen */
+    class MemoryRenderDevice : public RenderDevice {
+    public:
+        /* present into caller-owned pixels, rows pitch bytes apart, converted to format */
+        MemoryRenderDevice(int width, int height, void* pixels, size_t pitch,
+                           const PixelFormat& format = PF_XRGB8888);
+        /* present into an IF_* image file mapped into memory, which then always
+         * holds the last frame; ready() is false if it can't be created */
+        MemoryRenderDevice(const char* filename, int width, int height, int type);
+        ~MemoryRenderDevice();
+
+        void* get_pixels() const { return pixels; }
+        size_t get_pitch() const { return pitch; }
+        const PixelFormat& get_format() const { return converter.format; }
+
+    private:
+        char* pixels;
+        size_t pitch;
+        PixelConverter converter;
+        std::vector<uint32_t> fill_row;
+        std::vector<unsigned char> fill_bytes;
+
+        /* the file mapping, if file-backed */
+        char* file_map;
+        size_t file_size;
+
+        virtual void copy_buffer(const void* buffer, size_t pitch);
+        virtual bool partial_present() const { return true; }
+        virtual void copy_rect(const void* buffer, size_t pitch, int x, int y, int w, int h);
+        virtual void fill_rect(int x, int y, int w, int h, uint32_t color);
+    };
+}
+
+#endif
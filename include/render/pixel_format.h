@@ -0,0 +1,47 @@
+#ifndef _PIXEL_FORMAT_H_
+#define _PIXEL_FORMAT_H_
+
+#include "types.h"
+#include "simd.h"
+
+namespace fbrender {
+
+    /* a packed little-endian pixel: bit positions and widths of each channel,
+     * as reported by fb_var_screeninfo; alpha bits are written as all ones */
+    struct PixelFormat {
+        int bytes_per_pixel;
+        int red_offset, red_length;
+        int green_offset, green_length;
+        int blue_offset, blue_length;
+        int alpha_offset, alpha_length;
+    };
+
+    /* the format everything is rendered in */
+    static const PixelFormat PF_XRGB8888 = { 4, 16, 8, 8, 8, 0, 8, 0, 0 };
+    static const PixelFormat PF_XBGR8888 = { 4, 0, 8, 8, 8, 16, 8, 0, 0 };
+    static const PixelFormat PF_ARGB8888 = { 4, 16, 8, 8, 8, 0, 8, 24, 8 };
+    static const PixelFormat PF_ABGR8888 = { 4, 0, 8, 8, 8, 16, 8, 24, 8 };
+    static const PixelFormat PF_RGB888 = { 3, 16, 8, 8, 8, 0, 8, 0, 0 };
+    static const PixelFormat PF_BGR888 = { 3, 0, 8, 8, 8, 16, 8, 0, 0 };
+    static const PixelFormat PF_RGB565 = { 2, 11, 5, 5, 6, 0, 5, 0, 0 };
+    static const PixelFormat PF_BGR565 = { 2, 0, 5, 5, 6, 11, 5, 0, 0 };
+
+    bool operator==(const PixelFormat& a, const PixelFormat& b);
+
+    /* converts rows of PF_XRGB8888 pixels to one format, with the constants the
+     * chosen kernel needs worked out up front */
+    struct PixelConverter {
+        PixelFormat format;
+        unsigned char shuffle[16];
+        uint32_t alpha;
+
+        void (*kernel)(const PixelConverter& pc, void* dst, const uint32_t* src, int count);
+
+        void convert(void* dst, const uint32_t* src, int count) const { kernel(*this, dst, src, count); }
+    };
+
+    /* converter for the given format using at most the given SIMD_* level */
+    PixelConverter make_pixel_converter(const PixelFormat& format, int level);
+}
+
+#endif
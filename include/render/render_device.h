@@ -3,114 +3,453 @@
 
 #include "transform.h"
 #include "vertex.h"
+#include "render/shading.h"
+
+#include <vector>
 
 namespace fbrender {
 
+    class WorkerPool;
+    class FramePresenter;
+    class CommandBuffer;
+    struct ShaderUniforms;
+    template <class Varyings> struct ShadedVertex;
+    template <class Varyings> struct ShadedTriangle;
+
     class RenderDevice {
     public:
         static const int DS_WIREFRAME = 0x1;
         static const int DS_COLOR = 0x2;
         static const int DS_LIGHTING = 0x4;
         static const int DS_TEXTURE_2D = 0x8;
+        /* evaluate lighting once per vertex and interpolate the lit color, which
+         * modulates the texture; takes the place of per-pixel DS_LIGHTING */
+        static const int DS_LIGHTING_GOURAUD = 0x10;
 
         static const int CF_RGB = 0x1;
         static const int CF_RGBA = 0x2;
 
+        /* texture filters; the mipmapping ones pick a level per span segment from
+         * the texture coordinate derivatives, out of a chain built on upload */
         static const int TF_NEAREST = 0x1;
+        static const int TF_LINEAR = 0x2;
+        static const int TF_NEAREST_MIPMAP_NEAREST = 0x4;
+        static const int TF_LINEAR_MIPMAP_LINEAR = 0x8;
+
+        static const int RM_SCANLINE = 0x1;
+        static const int RM_HALF_SPACE = 0x2;
+
+        /* pixel colors are computed in float, or in 8.8 fixed point saturated only
+         * when packed; the fixed-point path may differ by a step per channel */
+        static const int CP_FLOAT = 0x1;
+        static const int CP_FIXED = 0x2;
+
+        /* screen tiles used by the multithreaded binned rasterizer */
+        static const int TILE_SIZE = 64;
+
+        /* swap_buffers() modes, see set_swap_mode() */
+        static const int SM_SYNC = 0x1;
+        static const int SM_QUEUE = 0x2;
+        static const int SM_MAILBOX = 0x4;
 
         RenderDevice() 
         { 
             initialized = false; 
-            framebuffer[0] = framebuffer[1] = nullptr;
+            framebuffer[0] = framebuffer[1] = framebuffer[2] = nullptr;
             pixel_buffer = nullptr;
+            presenter = nullptr;
+            swap_mode = SM_SYNC;
+            stats_enabled = false;
             zbuffer = nullptr;
-            texbuffer = nullptr;
+            shading.texture = nullptr;
+            /* texture 0 always exists and is bound until another one is */
+            textures.push_back(new Texture());
+            bound_texture = 0;
+            workers = nullptr;
         }
 
-        ~RenderDevice();
+        virtual ~RenderDevice();
 
         bool ready() { return initialized; }
 
-        void set_world(const Matrix4& mat) { transform.set_world(mat); light_world_pos = light_pos * mat; }
+        void set_world(const Matrix4& mat) { transform.set_world(mat); shading_dirty = true; }
         void set_camera(const Vector4& pos, const Vector4& at, const Vector4& up);
         void set_projection(const Matrix4& mat) { transform.set_projection(mat); }
 
-        void set_light_pos(const Vector4& pos) { light_pos = pos; light_world_pos = light_pos * transform.get_world(); }
-        void set_light_ambient(const Color& amb) { ambient_color = amb; }
-        void set_light_diffuse(const Color& diff) { diffuse_color = diff; }
-        void set_light_specular(const Color& spec) { specular_color = spec; }
+        void set_light_pos(const Vector4& pos) { transform.set_light_pos(pos); shading_dirty = true; }
+        void set_light_ambient(const Color& amb) { shading.ambient_color = amb; shading_dirty = true; }
+        void set_light_diffuse(const Color& diff) { shading.diffuse_color = diff; shading_dirty = true; }
+        void set_light_specular(const Color& spec) { shading.specular_color = spec; shading_dirty = true; }
 
-        void set_material_ambient(const Color& amb) { material_ambient = amb; }
-        void set_material_diffuse(const Color& diff) { material_diffuse = diff; }
-        void set_material_specular(const Color& spec) { material_specular = spec; }
-        void set_material_emission(const Color& emi) { material_emission = emi; }
-        void set_shininess(Real shi) { material_shininess = shi; }
+        void set_material_ambient(const Color& amb) { shading.material_ambient = amb; shading_dirty = true; }
+        void set_material_diffuse(const Color& diff) { shading.material_diffuse = diff; shading_dirty = true; }
+        void set_material_specular(const Color& spec) { shading.material_specular = spec; shading_dirty = true; }
+        void set_material_emission(const Color& emi) { shading.material_emission = emi; shading_dirty = true; }
+        void set_shininess(Real shi) { shading.material_shininess = shi; shading_dirty = true; }
 
+        /* texture objects: names index a table of textures that keep their converted
+         * pixels and mip chain, so switching between them is a pointer swap.
+         * texture_image_2d() replaces the image of the bound texture */
+        int create_texture();
+        void bind_texture(int name);
+        void delete_texture(int name);
         void texture_image_2d(int width, int height, int format, const void* tex);
-        void set_texture_filter(int filter) { tex_filter = filter; }
+        void set_texture_filter(int filter) { shading.tex_filter = filter; shading_dirty = true; }
 
-        void enable(int state) { drawing_state |= state; }
-        void disable(int state) { drawing_state &= ~state; }
+        /* RM_SCANLINE only applies without worker threads, see set_worker_threads() */
+        void set_raster_mode(int mode) { raster_mode = mode; }
+        /* distance in pixels between exact perspective corrections along a span,
+         * rounded down to a power of two no larger than TILE_SIZE */
+        void set_subspan_length(int n);
+
+        /* with n > 0 triangles are binned into screen tiles and rasterized by n threads
+         * (including the caller) on flush() or swap_buffers(); 0 renders immediately.
+         * Binned triangles are always rasterized with half-space edge functions,
+         * which can be confined to a tile, whatever the raster mode */
+        void set_worker_threads(int n);
+
+        /* widest SIMD_* instruction set the pixel shading may use, capped at what the CPU supports */
+        void set_simd_level(int level) { simd_level = level; shading_dirty = true; }
+        void set_color_path(int path) { color_path = path; shading_dirty = true; }
+
+        void enable(int state) { shading.drawing_state |= state; shading_dirty = true; }
+        void disable(int state) { shading.drawing_state &= ~state; shading_dirty = true; }
 
         void clear();
         void clear_color(const Color& color);
         void draw_pixel(int x, int y, uint32_t color);
         void draw_line(int x1, int y1, int x2, int y2, uint32_t color);
         void draw_triangle(const Vertex& v1, const Vertex& v2, const Vertex& v3);
+        void draw_indexed(const Vertex* verts, size_t nverts, const uint32_t* indices, size_t nidx);
+        /* same as above for structure-of-arrays input, which is transformed in one batch */
+        void draw_indexed(const VertexStream& verts, const uint32_t* indices, size_t nidx);
+        /* draws what was recorded into commands in state and depth order, see
+         * render/command_buffer.h; the world, drawing state, texture and material
+         * of the device are left as they were */
+        void execute(CommandBuffer& commands);
+        /* indexed triangles through a shader instead of the fixed-function stages,
+         * see render/shader.h. The DS_* state doesn't apply. Back faces are culled
+         * by the eye-space test of the other draws, on positions taken back from
+         * clip space through the device's projection, and the depth test is done
+         * as for the other draws; the triangles are rasterized with half-space
+         * edge functions before the call returns */
+        template <class Shader, class Input>
+        void draw_shaded(const Shader& shader, const Input* verts, size_t nverts, const uint32_t* indices, size_t nidx);
+        /* the fixed-function transform, light, material and texture for shaders */
+        ShaderUniforms shader_uniforms();
+        /* whether the textures of a state are sampled from mip levels chosen per segment */
+        static bool mipmapped(const ShadingState& st)
+        {
+            return (st.features & SF_TEXTURE) && (st.tex_filter & (TF_NEAREST_MIPMAP_NEAREST | TF_LINEAR_MIPMAP_LINEAR));
+        }
+        void flush();
         void swap_buffers();
+
+        /* SM_SYNC presents the frame before swap_buffers() returns. The other modes
+         * hand it to a presenter thread and render the next frame into a third
+         * buffer meanwhile, so a buffer's old contents are three frames behind.
+         * With SM_QUEUE swap_buffers() waits while an earlier frame is still queued,
+         * with SM_MAILBOX it never waits and that frame is dropped instead. Returns
+         * false for devices that render into their own buffers, which stay SM_SYNC */
+        bool set_swap_mode(int mode);
+
+        /* frames passed to swap_buffers(), presented and dropped so far */
+        struct PresentStats {
+            unsigned long queued, presented, dropped;
+        };
+        PresentStats get_present_stats() const;
+
+        /* pipeline counters for one frame */
+        struct RenderStats {
+            unsigned long triangles_submitted;
+            unsigned long triangles_culled;
+            unsigned long triangles_cvv_rejected;
+            unsigned long triangles_rasterized;
+            /* covered pixels, whether or not they passed the depth test */
+            unsigned long fragments;
+            unsigned long depth_rejected;
+            unsigned long pixels_written;
+            unsigned long texture_samples;
+            /* pixels written per pixel of the screen */
+            Real overdraw;
+        };
+
+        /* while enabled, counters are gathered for each frame and get_stats()
+         * returns those of the frame last passed to swap_buffers(); disabled,
+         * counting costs a flag test per span */
+        void set_stats_enabled(bool enable);
+        const RenderStats& get_stats() const { return frame_stats; }
+
+        /* half-open pixel rectangle */
+        struct Rect {
+            int x0, y0, x1, y1;
+        };
+
+        /* the parts of the screen the next swap_buffers() will update: tiles drawn
+         * into, or cleared, since the last present and different from what is shown */
+        void get_dirty_regions(std::vector<Rect>& regions);
     private:
+
         Transform transform;
         int width;
         int height;
 
+        /* color and depth buffers are single contiguous allocations whose rows
+         * start on a BUFFER_ALIGNMENT boundary, pixel (x, y) lives at y * pitch + x */
+        static const int BUFFER_ALIGNMENT = 64;
+        static const int BUFFER_COUNT = 3;
         uint32_t* pixel_buffer;
-        uint32_t** framebuffer[2];
+        uint32_t* framebuffer[BUFFER_COUNT];
         size_t framebuffer_size;
         int buffer_index;
+        int spare_buffer;
+        int pitch;
 
-        Real** zbuffer;
-        int drawing_state;
-        bool initialized;
+        Real* zbuffer;
 
-        uint32_t** texbuffer;
-        int tex_filter;
-        int tex_width;
-        int tex_height;
+        static int aligned_pitch(int width);
+        void allocate_zbuffer();
+
+        /* hierarchical z: the farthest and nearest invw stored in each HIZ_BLOCK
+         * square of the z-buffer, the farthest also per block row so that it can
+         * be refreshed after a span without rescanning the block. TILE_SIZE is a
+         * multiple of HIZ_BLOCK, so every block belongs to a single tile */
+        static const int HIZ_BLOCK = 8;
+        static const int HIZ_OCCLUDED = 0;
+        static const int HIZ_VISIBLE = 1;
+        static const int HIZ_PARTIAL = 2;
+        int hiz_blocks_x, hiz_blocks_y;
+        std::vector<Real> hiz_min;
+        std::vector<Real> hiz_max;
+        std::vector<Real> hiz_row_min;
+
+        void reset_hiz();
+        bool hiz_occluded(int x0, int y0, int x1, int y1, Real max_invw);
+        int hiz_test(int y, int x0, int x1, const Real* base, const Real* dadx);
+        void hiz_update(int y, int x);
+        /* margin for the rounding differences between the hierarchical z bounds and the
+         * kernels' own evaluation of invw, m bounds the magnitude of the terms involved */
+        static Real hiz_slack(Real m) { return m * (Real)1e-5; }
+
+        int raster_mode;
+        int subspan_length;
+        int simd_level;
+        int color_path;
+        bool initialized;
 
         uint32_t background;
-        uint32_t foreground;
 
-        Vector4 camera_pos;
-        Vector4 camera_world_pos;
-        Vector4 light_pos;
-        Vector4 light_world_pos;
-        /* light colors */
-        Color ambient_color;
-        Color diffuse_color;
-        Color specular_color;
+        ShadingState shading;
+        /* shading changed since its derived fields were computed */
+        bool shading_dirty;
+        /* the derived state differs from the last snapshot taken for the bins */
+        bool snapshot_stale;
 
-        Color material_ambient;
-        Color material_diffuse;
-        Color material_specular;
-        Color material_emission;
-        Real material_shininess;
+        /* tile binning */
+        struct BinnedTriangle {
+            Vertex v[3];
+            uint32_t state;
+        };
+        WorkerPool* workers;
+        int tiles_x, tiles_y;
+        std::vector<BinnedTriangle> binned_triangles;
+        std::vector<std::vector<uint32_t> > tile_bins;
+        std::vector<ShadingState> state_snapshots;
 
-        bool back_face_test(const Vertex& v1, const Vertex& v2, const Vertex& v3);
+        /* lazy clear: clear() only marks the tiles, a tile's color (kept per buffer)
+         * and depth receive their clear values when something is first drawn into it */
+        std::vector<unsigned char> color_cleared[BUFFER_COUNT];
+        std::vector<unsigned char> depth_cleared;
+        uint32_t clear_value[BUFFER_COUNT];
 
-        void rasterize_triangle(const Vertex& v1, const Vertex& v2, const Vertex& v3);
-        void draw_triangle_top(const Vertex& v1, const Vertex& v2, const Vertex& v3);
-        void draw_triangle_bottom(const Vertex& v1, const Vertex& v2, const Vertex& v3);
-        void draw_scan_line(const Vertex& left, const Vertex& right, int y_index);
+        Rect tile_rect(int tile) const;
+        void materialize_tile(int tile);
+        int touch_tile(int x, int y)
+        {
+            int tile = (y / TILE_SIZE) * tiles_x + x / TILE_SIZE;
+            tile_frame[buffer_index][tile] = frame_number;
+            if (color_cleared[buffer_index][tile] | depth_cleared[tile]) materialize_tile(tile);
+            return tile;
+        }
 
-        void lighting(Vertex& v, const Vector4& normal);
+        /* statistics: triangle counters are only updated by the calling thread,
+         * pixel counters per tile by the thread rendering the tile */
+        bool stats_enabled;
+        RenderStats stats;
+        RenderStats frame_stats;
+        std::vector<RenderStats> tile_stats;
 
-        void clear_texbuffer();
+        void reset_stats();
+        void count_plot(int tile)
+        {
+            if (stats_enabled) {
+                tile_stats[tile].fragments++;
+                tile_stats[tile].pixels_written++;
+            }
+        }
+
+        /* dirty tracking: the frame each tile of each buffer was last drawn into,
+         * and for each tile of the output whether it shows a clear value or the
+         * contents of a given frame. The output side is only touched by whoever
+         * presents, buffer_frame is the frame each buffer was last submitted as */
+        static const int PRESENT_SKIP = 0;
+        static const int PRESENT_FILL = 1;
+        static const int PRESENT_COPY = 2;
+        uint32_t frame_number;
+        std::vector<uint32_t> tile_frame[BUFFER_COUNT];
+        uint32_t buffer_frame[BUFFER_COUNT];
+        std::vector<unsigned char> shown_cleared;
+        std::vector<uint32_t> shown_value;
+        std::vector<uint32_t> shown_frame;
+
+        void forget_shown();
+        int present_action(int buffer, int tile) const;
+        void mark_shown(int buffer, int tile);
+        template <class Emit> void for_each_present_run(int buffer, Emit emit);
+        void present_buffer(int buffer);
+
+        /* asynchronous present: the thread owning the output, or null for SM_SYNC */
+        FramePresenter* presenter;
+        int swap_mode;
+        PresentStats present_totals;
+
+        void stop_presenter();
+
+        /* the shading state with its derived fields (light position, features,
+         * kernel and attributes) brought up to date if it changed */
+        const ShadingState& current_shading_state();
+        void bin_triangle(const Vertex& p1, const Vertex& p2, const Vertex& p3, const ShadingState& st);
+        void render_tile(int tile);
+        void discard_bins();
+
+        /* clip outcodes: which planes of the view volume and of the guard band,
+         * GUARD_BAND times wider and taller, a vertex lies outside of. Triangles
+         * that only leave the viewport are rasterized scissored to the screen,
+         * the CLIP_GEOMETRY planes they cross are clipped in homogeneous space */
+        static const int CLIP_NEAR = 0x1;
+        static const int CLIP_FAR = 0x2;
+        static const int CLIP_LEFT = 0x4;
+        static const int CLIP_RIGHT = 0x8;
+        static const int CLIP_BOTTOM = 0x10;
+        static const int CLIP_TOP = 0x20;
+        static const int GUARD_LEFT = 0x40;
+        static const int GUARD_RIGHT = 0x80;
+        static const int GUARD_BOTTOM = 0x100;
+        static const int GUARD_TOP = 0x200;
+        static const int CLIP_GEOMETRY = CLIP_NEAR | CLIP_FAR | GUARD_LEFT | GUARD_RIGHT | GUARD_BOTTOM | GUARD_TOP;
+        static const int GUARD_BAND = 8;
+
+        /* post-transform vertex cache entry, screen is set unless the outcode has
+         * CLIP_GEOMETRY bits; clip holds the clip-space position and attributes
+         * not yet divided by w for vertices outside the viewport */
+        struct TransformedVertex {
+            Vector4 eye_pos;
+            Vertex screen;
+            Vertex clip;
+            int outcode;
+            bool valid;
+        };
+        std::vector<TransformedVertex> vertex_cache;
+        std::vector<Real> stream_buffer;
+        std::vector<unsigned char> stream_clipped;
+
+        void transform_vertex(const Vertex& v, TransformedVertex& tv);
+        void assemble_triangle(const Vector4& o1, const Vector4& o2, const Vector4& o3,
+                               const TransformedVertex& t1, const TransformedVertex& t2, const TransformedVertex& t3);
+        void submit_triangle(Vertex p1, Vertex p2, Vertex p3, const Vector4& normal);
+        void clip_triangle(const TransformedVertex& t1, const TransformedVertex& t2, const TransformedVertex& t3,
+                           int planes, const Vector4& normal);
+        static int clip_outcode(const Vector4& clip);
+        static Real clip_distance(const Vector4& clip, int plane);
+        Vertex project_clipped(const Vertex& clip);
+        Vertex unproject(const Vertex& screen);
+
+        bool back_face_test(const Vector4& p1, const Vector4& p2, const Vector4& p3);
+        /* the test back_face_test() does outside wireframe mode */
+        static bool front_facing(const Vector4& p1, const Vector4& p2, const Vector4& p3);
+
+        void draw_primitive(const Vertex& p1, const Vertex& p2, const Vertex& p3,
+                            const ShadingState& st, const Rect& clip);
+        void draw_line_clipped(int x1, int y1, int x2, int y2, uint32_t color, const Rect& clip);
+
+        void rasterize_triangle(const Vertex& v1, const Vertex& v2, const Vertex& v3, const ShadingState& st);
+        void draw_triangle_top(const Vertex& v1, const Vertex& v2, const Vertex& v3,
+                               const Real* dady, const ShadingState& st);
+        void draw_triangle_bottom(const Vertex& v1, const Vertex& v2, const Vertex& v3,
+                                  const Real* dady, const ShadingState& st);
+        void draw_scan_line(const Vertex& left, const Vertex& right, int y_index,
+                            const Real* dady, const ShadingState& st);
+
+        /* half-space rasterizer, edge functions use SUBPIXEL_BITS of fixed-point precision */
+        static const int SUBPIXEL_BITS = 8;
+        void rasterize_triangle_half_space(const Vertex& v1, const Vertex& v2, const Vertex& v3,
+                                           const ShadingState& st, const Rect& clip);
+        /* the setup both pipelines share: x, y and a hold the screen position and
+         * attributes of each vertex, a[i][ATTR_INVW] is 1 / w and only the
+         * attr_count attributes listed in attrs are interpolated. Calls
+         * span(y, x0, x1, base, dadx, dady) for every covered row */
+        template <int N, class Span>
+        void rasterize_half_space(const Real* x, const Real* y, const Real* const* a,
+                                  const int* attrs, int attr_count, const Rect& clip, Span span);
+
+        static void load_attributes(const Vertex& v, Real* attr);
+        /* dady is only needed, and may otherwise be null, when mipmapped() */
+        void draw_span(int y, int x0, int x1, const Real* base, const Real* dadx, const Real* dady,
+                       const ShadingState& st);
+        /* the span loop both pipelines share: perspective correction at anchors
+         * and the hierarchical z test, calling setup(seg) once per segment and
+         * shade(seg) for each run of it to shade, which returns the pixels written */
+        template <class Setup, class Shade>
+        void shade_span(int y, int x0, int x1, const Real* base, const Real* dadx,
+                        const int* attrs, int attr_count, bool textured, Setup setup, Shade shade);
+
+        void lighting(Vertex& v, const Vector4& normal, const ShadingState& st);
+
+        /* programmable pipeline, render/shader_pipeline.h */
+        template <class Varyings> void project_shaded(ShadedVertex<Varyings>& v);
+        template <class Varyings> void clip_shaded(const ShadedVertex<Varyings>& v1, const ShadedVertex<Varyings>& v2,
+                                                   const ShadedVertex<Varyings>& v3, int planes,
+                                                   std::vector<ShadedTriangle<Varyings> >& out);
+        template <class Shader> void rasterize_shaded(const Shader& shader, const ShadedTriangle<typename Shader::Varyings>& tri,
+                                                      const Rect& clip);
+
+        /* indexed by texture name, deleted names are null until reused */
+        std::vector<Texture*> textures;
+        int bound_texture;
+        static void free_texture_image(Texture* tex);
     protected:
         void init(int width, int height);
 
-        virtual void copy_buffer(const void* buffer, size_t size) = 0;
+        /* render into two color buffers owned by the device, e.g. pages of video
+         * memory, with rows pitch pixels apart; null buffers restore the internal
+         * ones. Both buffers start out cleared and buffer0 is drawn into first.
+         * Either way the device returns to SM_SYNC */
+        void set_color_buffers(uint32_t* buffer0, uint32_t* buffer1, int pitch);
+
+        int get_width() const { return width; }
+        int get_height() const { return height; }
+
+        /* buffer holds get_height() rows of get_width() pixels, pitch bytes apart.
+         * This and the calls below come from the presenter thread outside SM_SYNC,
+         * so devices call set_swap_mode(SM_SYNC) before they are destroyed */
+        virtual void copy_buffer(const void* buffer, size_t pitch) = 0;
+
+        /* devices that can update part of their output return true here, and are
+         * then given each frame as copy_rect() and fill_rect() calls covering the
+         * screen instead of copy_buffer(), so that areas left cleared are filled
+         * directly. copy_rect() takes the same buffer as copy_buffer() */
+        virtual bool partial_present() const { return false; }
+        virtual void copy_rect(const void* /* buffer */, size_t /* pitch */, int /* x */, int /* y */, int /* w */, int /* h */) {}
+        virtual void fill_rect(int /* x */, int /* y */, int /* w */, int /* h */, uint32_t /* color */) {}
+
+        /* called by swap_buffers() on the caller's thread once the frame is handed
+         * over and before the next one is drawn, where devices may change their
+         * color buffers */
+        virtual void frame_swapped() {}
     };
 }
 
+#include "render/shader_pipeline.h"
+
 #endif
 
@@ -0,0 +1,178 @@
+#ifndef _SHADER_H_
+#define _SHADER_H_
+
+#include "matrix4.h"
+#include "vertex.h"
+#include "render/render_device.h"
+#include "render/shading.h"
+
+namespace fbrender {
+
+    /*
+     * Programmable pipeline. A shader is a class with
+     *
+     *   struct Varyings { Real ...; };
+     *       values passed from the vertex to the pixel stage, interpolated
+     *       perspective-correct across the triangle; Real members only
+     *   Vector4 vertex(const Input& in, Varyings& out) const;
+     *       the clip-space position of a vertex of the draw, any Input type
+     *   uint32_t fragment(const Varyings& in) const;
+     *       the color of a pixel that passed the depth test
+     *
+     * and, where it needs them,
+     *
+     *   void triangle(const Input& a, const Input& b, const Input& c,
+     *                 Varyings& va, Varyings& vb, Varyings& vc) const;
+     *       called for every front-facing triangle before it is clipped, with
+     *       copies of the varyings of its vertices, for values that depend on
+     *       the whole triangle such as its face normal
+     *   int shade(SpanSegment& seg, const Real* dadx, const Real* dady) const;
+     *       shades a run of pixels in place of fragment(), e.g. several at a
+     *       time. Attribute 0 of seg is invw and attribute k + 1 the k-th
+     *       varying, as the fixed-function kernels read them; dadx and dady
+     *       are the screen gradients of the attributes divided by w, for
+     *       select_texture_lod(). Returns the pixels written
+     *   int attributes(int* attrs) const;
+     *       fills attrs with the attributes shade() reads, 0 first, and returns
+     *       their number; the others are not interpolated
+     *
+     * RenderDevice::draw_shaded() is a template on the shader, so the stages are
+     * inlined into the rasterizer. Uniforms are members of the shader.
+     */
+
+    /* the fixed-function state, for shaders that want to follow it */
+    struct ShaderUniforms {
+        Matrix4 world;
+        Matrix4 world_view;
+        Matrix4 projection;
+        Matrix4 world_view_projection;
+        /* transforms object-space normals to world space */
+        Matrix4 normal_matrix;
+        Vector4 light_world_pos;
+        Color ambient_color;
+        Color diffuse_color;
+        Color material_diffuse;
+        /* the bound texture, null if it has no image */
+        const Texture* texture;
+        int tex_filter;
+        /* the RenderDevice::set_simd_level() and set_color_path() settings */
+        int simd_level;
+        int color_path;
+    };
+
+    /* the diffuse model of DS_LIGHTING */
+    inline Color diffuse_lighting(const ShaderUniforms& u, const Vector4& world_pos, Vector4 normal)
+    {
+        normal.normalize();
+
+        Vector4 light_dir = world_pos - u.light_world_pos;
+        light_dir.normalize();
+
+        Real kdiffuse = light_dir.dot_product(normal);
+        if (kdiffuse < 0) kdiffuse = 0;
+
+        return (u.material_diffuse * kdiffuse + u.diffuse_color * kdiffuse) + u.ambient_color;
+    }
+
+    /*
+     * The DS_* modes as shaders on Vertex input. They transform, light and
+     * shade as the fixed-function pipeline does: lighting uses the face normal
+     * of each triangle, textures are filtered by the bound filter, and pixels
+     * go through the same specialized kernels, so a draw gives the image of
+     * the same draw_indexed() under RM_HALF_SPACE. DS_LIGHTING_GOURAUD lights
+     * the vertices before clipping rather than after, which only shows on
+     * triangles that cross the near plane or the guard band.
+     */
+    template <int DS>
+    struct FixedFunctionShader {
+        /* in the order of the ATTR_* attributes the kernels read */
+        struct Varyings {
+            Real u, v;
+            Real r, g, b;
+            Real wx, wy, wz;
+            Real nx, ny, nz;
+        };
+
+        FixedFunctionShader(const ShaderUniforms& u) : uniforms(u)
+        {
+            st = ShadingState();
+            st.drawing_state = DS;
+            st.texture = u.texture;
+            st.tex_filter = u.tex_filter;
+            st.light_world_pos = u.light_world_pos;
+            st.ambient_color = u.ambient_color;
+            st.diffuse_color = u.diffuse_color;
+            st.material_diffuse = u.material_diffuse;
+            derive_shading_state(st, u.simd_level, u.color_path);
+            mipmapped = RenderDevice::mipmapped(st);
+        }
+
+        Vector4 vertex(const Vertex& in, Varyings& out) const
+        {
+            const Vector4& pos = in.get_pos();
+            const Color& c = in.get_color();
+            Vector4 world_pos = pos * uniforms.world;
+            out.u = in.get_texcoord().u;
+            out.v = in.get_texcoord().v;
+            out.r = c.r;
+            out.g = c.g;
+            out.b = c.b;
+            out.wx = world_pos.x;
+            out.wy = world_pos.y;
+            out.wz = world_pos.z;
+            out.nx = out.ny = out.nz = 0;
+            /* in two steps as the fixed-function transform does, for the same rounding */
+            return pos * uniforms.world_view * uniforms.projection;
+        }
+
+        void triangle(const Vertex& a, const Vertex& b, const Vertex& c, Varyings& va, Varyings& vb, Varyings& vc) const
+        {
+            if (!(DS & (RenderDevice::DS_LIGHTING | RenderDevice::DS_LIGHTING_GOURAUD))) return;
+
+            Vector4 edge1 = b.get_pos() - a.get_pos();
+            Vector4 edge2 = c.get_pos() - b.get_pos();
+            Vector4 normal = edge1.cross_product(edge2) * uniforms.normal_matrix;
+
+            Varyings* vs[3] = { &va, &vb, &vc };
+            for (int i = 0; i < 3; i++) {
+                Varyings& v = *vs[i];
+                if (DS & RenderDevice::DS_LIGHTING_GOURAUD) {
+                    /* without vertex colors the light itself modulates the texture */
+                    Color light = diffuse_lighting(uniforms, Vector4(v.wx, v.wy, v.wz), normal);
+                    Color color = (DS & RenderDevice::DS_COLOR) ? Color(v.r, v.g, v.b) * light : light;
+                    v.r = color.r;
+                    v.g = color.g;
+                    v.b = color.b;
+                }
+                v.nx = normal.x;
+                v.ny = normal.y;
+                v.nz = normal.z;
+            }
+        }
+
+        int shade(SpanSegment& seg, const Real* dadx, const Real* dady) const
+        {
+            if (mipmapped) select_texture_lod(seg, st, seg.start, dadx, dady);
+            return st.kernel(seg, st);
+        }
+
+        int attributes(int* attrs) const
+        {
+            for (int k = 0; k < st.attr_count; k++) attrs[k] = st.attrs[k];
+            return st.attr_count;
+        }
+
+        ShaderUniforms uniforms;
+        ShadingState st;
+        bool mipmapped;
+    };
+
+    typedef FixedFunctionShader<RenderDevice::DS_COLOR> ColorShader;
+    typedef FixedFunctionShader<RenderDevice::DS_TEXTURE_2D> TextureShader;
+    typedef FixedFunctionShader<RenderDevice::DS_COLOR | RenderDevice::DS_LIGHTING> LitColorShader;
+    typedef FixedFunctionShader<RenderDevice::DS_TEXTURE_2D | RenderDevice::DS_LIGHTING> LitTextureShader;
+    typedef FixedFunctionShader<RenderDevice::DS_COLOR | RenderDevice::DS_LIGHTING_GOURAUD> GouraudColorShader;
+    typedef FixedFunctionShader<RenderDevice::DS_TEXTURE_2D | RenderDevice::DS_LIGHTING_GOURAUD> GouraudTextureShader;
+}
+
+#endif
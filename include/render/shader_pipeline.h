@@ -0,0 +1,469 @@
+#ifndef _SHADER_PIPELINE_H_
+#define _SHADER_PIPELINE_H_
+
+/* template members of RenderDevice, included at the end of render_device.h */
+
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace fbrender {
+
+    /* clip holds the clip-space position and eye the eye-space one for back
+     * face culling; x, y and invw the screen position, set once the vertex is
+     * inside the guard band */
+    template <class Varyings>
+    struct ShadedVertex {
+        Vector4 clip;
+        Vector4 eye;
+        Real x, y, invw;
+        int outcode;
+        Varyings var;
+    };
+
+    template <class Varyings>
+    struct ShadedTriangle {
+        ShadedVertex<Varyings> v[3];
+    };
+
+    /* the optional shader stages, see render/shader.h; the int overloads are
+     * preferred and drop out when the shader lacks the stage */
+    template <class Shader, class Input, class Varyings>
+    inline auto shader_triangle(const Shader& shader, const Input& a, const Input& b, const Input& c,
+                                Varyings& va, Varyings& vb, Varyings& vc, int)
+        -> decltype(shader.triangle(a, b, c, va, vb, vc))
+    {
+        shader.triangle(a, b, c, va, vb, vc);
+    }
+
+    template <class Shader, class Input, class Varyings>
+    inline void shader_triangle(const Shader&, const Input&, const Input&, const Input&,
+                                Varyings&, Varyings&, Varyings&, long)
+    {
+    }
+
+    template <class Shader>
+    inline auto shader_attributes(const Shader& shader, int* attrs, int) -> decltype(shader.attributes(attrs))
+    {
+        return shader.attributes(attrs);
+    }
+
+    template <class Shader>
+    inline int shader_attributes(const Shader&, int* attrs, long)
+    {
+        const int n = sizeof(typename Shader::Varyings) / sizeof(Real) + 1;
+        for (int k = 0; k < n; k++) attrs[k] = k;
+        return n;
+    }
+
+    template <class Shader>
+    inline auto shader_shade(const Shader& shader, SpanSegment& seg, const Real* dadx, const Real* dady, int)
+        -> decltype(shader.shade(seg, dadx, dady))
+    {
+        return shader.shade(seg, dadx, dady);
+    }
+
+    /* fragment() for each pixel, with the varyings stepped as the kernels step attributes */
+    template <class Shader>
+    inline int shader_shade(const Shader& shader, SpanSegment& seg, const Real*, const Real*, long)
+    {
+        typedef typename Shader::Varyings Varyings;
+        const int n = sizeof(Varyings) / sizeof(Real);
+        int written = 0;
+
+        for (int i = seg.first; i < seg.count; i++) {
+            Real invw = seg.start[ATTR_INVW] + (Real)i * seg.step[ATTR_INVW];
+            if (seg.depth_test && !(invw >= seg.depth[i])) continue;
+
+            Varyings var;
+            Real* v = (Real*)&var;
+            for (int k = 0; k < n; k++) v[k] = seg.start[k + 1] + (Real)i * seg.step[k + 1];
+
+            seg.depth[i] = invw;
+            seg.color[i] = shader.fragment(var);
+            written++;
+        }
+        return written;
+    }
+
+    template <int N, class Span>
+    void RenderDevice::rasterize_half_space(const Real* x, const Real* y, const Real* const* a,
+                                            const int* attrs, int attr_count, const Rect& clip, Span span)
+    {
+        const int64_t one = 1 << SUBPIXEL_BITS;
+        int vs[3] = { 0, 1, 2 };
+
+        /* snap to the subpixel grid */
+        int64_t x1 = llround(x[0] * one), y1 = llround(y[0] * one);
+        int64_t x2 = llround(x[1] * one), y2 = llround(y[1] * one);
+        int64_t x3 = llround(x[2] * one), y3 = llround(y[2] * one);
+
+        int64_t area = (x2 - x1) * (y3 - y1) - (y2 - y1) * (x3 - x1);
+        if (area == 0) return;
+        if (area < 0) {
+            /* make the winding consistent so that the inside of every edge is positive */
+            std::swap(x2, x3);
+            std::swap(y2, y3);
+            std::swap(vs[1], vs[2]);
+            area = -area;
+        }
+
+        int minx = (int)(std::min(x1, std::min(x2, x3)) >> SUBPIXEL_BITS);
+        int maxx = (int)(std::max(x1, std::max(x2, x3)) >> SUBPIXEL_BITS);
+        int miny = (int)(std::min(y1, std::min(y2, y3)) >> SUBPIXEL_BITS);
+        int maxy = (int)(std::max(y1, std::max(y2, y3)) >> SUBPIXEL_BITS);
+        minx = std::max(minx, clip.x0);
+        miny = std::max(miny, clip.y0);
+        maxx = std::min(maxx, clip.x1 - 1);
+        maxy = std::min(maxy, clip.y1 - 1);
+        if (minx > maxx || miny > maxy) return;
+
+        /* edge functions evaluated at the center of the first pixel; edges that are
+         * not top or left edges are biased by one so that pixels exactly on them are
+         * left to the neighbouring triangle */
+        int64_t px = minx * one + one / 2;
+        int64_t py = miny * one + one / 2;
+
+#define EDGE(xa, ya, xb, yb) (((xb) - (xa)) * (py - (ya)) - ((yb) - (ya)) * (px - (xa)))
+#define TOP_LEFT(xa, ya, xb, yb) (((yb) < (ya)) || ((yb) == (ya) && (xb) > (xa)))
+        int64_t e12_row = EDGE(x1, y1, x2, y2) - (TOP_LEFT(x1, y1, x2, y2) ? 0 : 1);
+        int64_t e23_row = EDGE(x2, y2, x3, y3) - (TOP_LEFT(x2, y2, x3, y3) ? 0 : 1);
+        int64_t e31_row = EDGE(x3, y3, x1, y1) - (TOP_LEFT(x3, y3, x1, y1) ? 0 : 1);
+#undef TOP_LEFT
+#undef EDGE
+
+        /* steps of one pixel; the deltas can be negative, so multiplied rather than shifted */
+        int64_t e12_dx = -(y2 - y1) * one, e12_dy = (x2 - x1) * one;
+        int64_t e23_dx = -(y3 - y2) * one, e23_dy = (x3 - x2) * one;
+        int64_t e31_dx = -(y1 - y3) * one, e31_dy = (x1 - x3) * one;
+
+        /* attribute plane equations in pixel units */
+        const Real* a1 = a[vs[0]];
+        const Real* a2 = a[vs[1]];
+        const Real* a3 = a[vs[2]];
+
+        Real inv_one = (Real)1.0 / one;
+        Real dx2 = (x2 - x1) * inv_one, dy2 = (y2 - y1) * inv_one;
+        Real dx3 = (x3 - x1) * inv_one, dy3 = (y3 - y1) * inv_one;
+        Real inv_area = (Real)1.0 / (dx2 * dy3 - dy2 * dx3);
+
+        Real dadx[N], dady[N], origin[N], base[N];
+        for (int k = 0; k < attr_count; k++) {
+            int i = attrs[k];
+            Real da2 = a2[i] - a1[i];
+            Real da3 = a3[i] - a1[i];
+            dadx[i] = (da2 * dy3 - dy2 * da3) * inv_area;
+            dady[i] = (dx2 * da3 - da2 * dx3) * inv_area;
+            /* value at the center of pixel (0, 0) */
+            origin[i] = a1[i] + dadx[i] * ((Real)0.5 - x1 * inv_one) + dady[i] * ((Real)0.5 - y1 * inv_one);
+        }
+
+        /* triangle-level hierarchical z test, invw inside the triangle doesn't
+         * exceed its largest vertex value */
+        Real max_invw = std::max(a1[ATTR_INVW], std::max(a2[ATTR_INVW], a3[ATTR_INVW]));
+        max_invw += hiz_slack(std::fabs(max_invw) + std::fabs(origin[ATTR_INVW]) +
+                              std::fabs(dadx[ATTR_INVW]) * (maxx + 1) + std::fabs(dady[ATTR_INVW]) * (maxy + 1));
+        if (hiz_occluded(minx, miny, maxx, maxy, max_invw)) return;
+
+        for (int y = miny; y <= maxy; y++) {
+            int64_t e12 = e12_row, e23 = e23_row, e31 = e31_row;
+            int x = minx;
+
+            /* coverage of a row is contiguous, skip to its first pixel */
+            while (x <= maxx && (e12 | e23 | e31) < 0) {
+                e12 += e12_dx;
+                e23 += e23_dx;
+                e31 += e31_dx;
+                x++;
+            }
+
+            int xs = x;
+            while (x <= maxx && (e12 | e23 | e31) >= 0) {
+                e12 += e12_dx;
+                e23 += e23_dx;
+                e31 += e31_dx;
+                x++;
+            }
+
+            if (xs < x) {
+                for (int k = 0; k < attr_count; k++) base[attrs[k]] = origin[attrs[k]] + dady[attrs[k]] * y;
+                span(y, xs, x - 1, (const Real*)base, (const Real*)dadx, (const Real*)dady);
+            }
+
+            e12_row += e12_dy;
+            e23_row += e23_dy;
+            e31_row += e31_dy;
+        }
+    }
+
+    template <class Varyings>
+    void RenderDevice::project_shaded(ShadedVertex<Varyings>& v)
+    {
+        /* the viewport mapping of Transform::homogenize */
+        Real invw = 1.0 / v.clip.w;
+        v.x = (v.clip.x * invw + (Real)1.0) * width * (Real)0.5;
+        v.y = ((Real)1.0 - v.clip.y * invw) * height * (Real)0.5;
+        v.invw = invw;
+    }
+
+    template <class Varyings>
+    void RenderDevice::clip_shaded(const ShadedVertex<Varyings>& v1, const ShadedVertex<Varyings>& v2,
+                                   const ShadedVertex<Varyings>& v3, int planes,
+                                   std::vector<ShadedTriangle<Varyings> >& out)
+    {
+        /* Sutherland-Hodgman as in clip_triangle(), varyings are linear in clip space */
+        const int n = sizeof(Varyings) / sizeof(Real);
+        ShadedVertex<Varyings> buffers[2][3 + 6];
+        ShadedVertex<Varyings>* poly = buffers[0];
+        ShadedVertex<Varyings>* next = buffers[1];
+        int count = 3;
+
+        poly[0] = v1;
+        poly[1] = v2;
+        poly[2] = v3;
+
+        for (int plane = CLIP_NEAR; plane <= GUARD_TOP; plane <<= 1) {
+            if (!(planes & plane)) continue;
+
+            int m = 0;
+            for (int i = 0; i < count; i++) {
+                const ShadedVertex<Varyings>& a = poly[i];
+                const ShadedVertex<Varyings>& b = poly[(i + 1) % count];
+                Real da = clip_distance(a.clip, plane);
+                Real db = clip_distance(b.clip, plane);
+
+                if (da >= 0) next[m++] = a;
+                if ((da >= 0) != (db >= 0)) {
+                    Real t = da / (da - db);
+                    ShadedVertex<Varyings>& c = next[m++];
+                    c.clip = a.clip + (b.clip - a.clip) * t;
+                    const Real* va = (const Real*)&a.var;
+                    const Real* vb = (const Real*)&b.var;
+                    Real* vc = (Real*)&c.var;
+                    for (int k = 0; k < n; k++) vc[k] = va[k] + (vb[k] - va[k]) * t;
+                }
+            }
+
+            std::swap(poly, next);
+            count = m;
+            if (count < 3) return;
+        }
+
+        /* the polygon is convex, draw it as a fan */
+        for (int i = 0; i < count; i++) project_shaded(poly[i]);
+        for (int i = 2; i < count; i++) {
+            out.push_back(ShadedTriangle<Varyings>());
+            ShadedTriangle<Varyings>& tri = out.back();
+            tri.v[0] = poly[0];
+            tri.v[1] = poly[i - 1];
+            tri.v[2] = poly[i];
+        }
+    }
+
+    template <class Setup, class Shade>
+    void RenderDevice::shade_span(int y, int x0, int x1, const Real* base, const Real* dadx,
+                                  const int* attrs, int attr_count, bool textured, Setup setup, Shade shade)
+    {
+        /* Attributes are interpolated affinely between anchor points where they are
+         * perspective-corrected exactly. Anchors sit on multiples of subspan_length
+         * (plus the span start) and are always evaluated from the span plane, so the
+         * result for a pixel doesn't depend on where the span was cut. */
+        Real cur[ATTR_COUNT], end[ATTR_COUNT], step[ATTR_COUNT];
+        const int n = subspan_length;
+
+#define PERSPECTIVE_CORRECT(out, xa) \
+        do { \
+            Real _invw = base[ATTR_INVW] + dadx[ATTR_INVW] * (xa); \
+            Real _w = 1 / _invw; \
+            (out)[ATTR_INVW] = _invw; \
+            for (int _k = 1; _k < attr_count; _k++) { \
+                int _i = attrs[_k]; \
+                (out)[_i] = (base[_i] + dadx[_i] * (xa)) * _w; \
+            } \
+        } while (0)
+
+        PERSPECTIVE_CORRECT(cur, x0);
+
+        int x = x0;
+        while (x <= x1) {
+            int xe = (x / n + 1) * n;
+            int last = std::min(xe - 1, x1);
+
+            /* the next anchor may lie past the end of the span; fall back to the last
+             * pixel if extrapolating it would cross w = 0 */
+            if (xe > x1 + 1 && base[ATTR_INVW] + dadx[ATTR_INVW] * xe <= 0) {
+                xe = x1 > x ? x1 : x + 1;
+            }
+
+            PERSPECTIVE_CORRECT(end, xe);
+
+            Real inv_len = (Real)1.0 / (xe - x);
+            step[ATTR_INVW] = dadx[ATTR_INVW];
+            for (int k = 1; k < attr_count; k++) {
+                int i = attrs[k];
+                step[i] = (end[i] - cur[i]) * inv_len;
+            }
+
+            /* segments end on multiples of subspan_length, which divides TILE_SIZE,
+             * so a segment never straddles two tiles */
+            int tile = touch_tile(x, y);
+
+            /* shade the segment one HIZ_BLOCK at a time, skipping blocks that are
+             * hidden and leaving out the depth read in blocks that are in front */
+            int sx = x;
+            int written = 0;
+            SpanSegment seg = { framebuffer[buffer_index] + y * pitch + sx, zbuffer + y * pitch + sx, 0, 0, cur, step, true, 0, 0 };
+            setup(seg);
+            while (x <= last) {
+                int xb = std::min((x / HIZ_BLOCK + 1) * HIZ_BLOCK - 1, last);
+                int visibility = hiz_test(y, x, xb, base, dadx);
+                if (visibility != HIZ_OCCLUDED) {
+                    seg.first = x - sx;
+                    seg.count = xb + 1 - sx;
+                    seg.depth_test = visibility == HIZ_PARTIAL;
+                    written += shade(seg);
+                    hiz_update(y, x);
+                }
+                x = xb + 1;
+            }
+
+            if (stats_enabled) {
+                RenderStats& ts = tile_stats[tile];
+                ts.fragments += last + 1 - sx;
+                ts.depth_rejected += last + 1 - sx - written;
+                ts.pixels_written += written;
+                if (textured) ts.texture_samples += written;
+            }
+
+            for (int k = 0; k < attr_count; k++) cur[attrs[k]] = end[attrs[k]];
+        }
+#undef PERSPECTIVE_CORRECT
+    }
+
+    template <class Shader>
+    void RenderDevice::rasterize_shaded(const Shader& shader, const ShadedTriangle<typename Shader::Varyings>& tri,
+                                        const Rect& clip)
+    {
+        /* attribute 0 is invw, followed by the varyings divided by w */
+        const int n = sizeof(typename Shader::Varyings) / sizeof(Real) + 1;
+        static_assert(n <= ATTR_COUNT, "the span loop steps at most ATTR_COUNT attributes");
+        Real x[3], y[3], a[3][n];
+        const Real* ap[3] = { a[0], a[1], a[2] };
+        int attrs[n];
+
+        for (int i = 0; i < 3; i++) {
+            const ShadedVertex<typename Shader::Varyings>& v = tri.v[i];
+            const Real* var = (const Real*)&v.var;
+            x[i] = v.x;
+            y[i] = v.y;
+            a[i][ATTR_INVW] = v.invw;
+            for (int k = 1; k < n; k++) a[i][k] = var[k - 1] * v.invw;
+        }
+        int attr_count = shader_attributes(shader, attrs, 0);
+
+        rasterize_half_space<n>(x, y, ap, attrs, attr_count, clip,
+            [&](int y, int x0, int x1, const Real* base, const Real* dadx, const Real* dady) {
+                shade_span(y, x0, x1, base, dadx, attrs, attr_count, false,
+                           [](SpanSegment&) { },
+                           [&](SpanSegment& seg) { return shader_shade(shader, seg, dadx, dady, 0); });
+            });
+    }
+
+    template <class Shader, class Input>
+    void RenderDevice::draw_shaded(const Shader& shader, const Input* verts, size_t nverts, const uint32_t* indices, size_t nidx)
+    {
+        typedef typename Shader::Varyings Varyings;
+        static_assert(sizeof(Varyings) % sizeof(Real) == 0, "varyings may only hold Real members");
+        static_assert(ATTR_INVW == 0, "invw leads the attributes");
+
+        /* fixed-function triangles binned so far were drawn first */
+        flush();
+
+        Matrix4 inv_projection = transform.get_projection().inverse();
+        std::vector<ShadedVertex<Varyings> > vs(nverts);
+        for (size_t i = 0; i < nverts; i++) {
+            ShadedVertex<Varyings>& v = vs[i];
+            v.clip = shader.vertex(verts[i], v.var);
+            v.eye = v.clip * inv_projection;
+            v.outcode = clip_outcode(v.clip);
+            if (!(v.outcode & CLIP_GEOMETRY)) project_shaded(v);
+        }
+
+        std::vector<ShadedTriangle<Varyings> > tris;
+        for (size_t i = 0; i + 2 < nidx; i += 3) {
+            uint32_t i1 = indices[i];
+            uint32_t i2 = indices[i + 1];
+            uint32_t i3 = indices[i + 2];
+
+            if (i1 >= nverts || i2 >= nverts || i3 >= nverts) continue;
+
+            if (stats_enabled) stats.triangles_submitted++;
+
+            if (!front_facing(vs[i1].eye, vs[i2].eye, vs[i3].eye)) {
+                if (stats_enabled) stats.triangles_culled++;
+                continue;
+            }
+
+            if (vs[i1].outcode & vs[i2].outcode & vs[i3].outcode) {
+                if (stats_enabled) stats.triangles_cvv_rejected++;
+                continue;
+            }
+
+            /* the triangle stage works on copies, the vertices are shared */
+            ShadedVertex<Varyings> v1 = vs[i1];
+            ShadedVertex<Varyings> v2 = vs[i2];
+            ShadedVertex<Varyings> v3 = vs[i3];
+            shader_triangle(shader, verts[i1], verts[i2], verts[i3], v1.var, v2.var, v3.var, 0);
+
+            int planes = (v1.outcode | v2.outcode | v3.outcode) & CLIP_GEOMETRY;
+            if (planes) {
+                clip_shaded(v1, v2, v3, planes, tris);
+            } else {
+                tris.push_back(ShadedTriangle<Varyings>());
+                ShadedTriangle<Varyings>& tri = tris.back();
+                tri.v[0] = v1;
+                tri.v[1] = v2;
+                tri.v[2] = v3;
+            }
+        }
+        if (stats_enabled) stats.triangles_rasterized += tris.size();
+
+        if (!workers) {
+            Rect screen = { 0, 0, width, height };
+            for (size_t i = 0; i < tris.size(); i++) {
+                rasterize_shaded(shader, tris[i], screen);
+            }
+            return;
+        }
+
+        /* bin into the (empty after the flush) tile bins and render tile by tile */
+        for (size_t i = 0; i < tris.size(); i++) {
+            const ShadedVertex<Varyings>* v = tris[i].v;
+            int tx0 = std::max((int)std::floor(std::min(v[0].x, std::min(v[1].x, v[2].x))), 0) / TILE_SIZE;
+            int ty0 = std::max((int)std::floor(std::min(v[0].y, std::min(v[1].y, v[2].y))), 0) / TILE_SIZE;
+            int tx1 = std::min((int)std::ceil(std::max(v[0].x, std::max(v[1].x, v[2].x))) / TILE_SIZE, tiles_x - 1);
+            int ty1 = std::min((int)std::ceil(std::max(v[0].y, std::max(v[1].y, v[2].y))) / TILE_SIZE, tiles_y - 1);
+            for (int ty = ty0; ty <= ty1; ty++) {
+                for (int tx = tx0; tx <= tx1; tx++) {
+                    tile_bins[ty * tiles_x + tx].push_back((uint32_t)i);
+                }
+            }
+        }
+
+        workers->run(tile_bins.size(), [&](size_t tile) {
+            const std::vector<uint32_t>& bin = tile_bins[tile];
+            Rect clip = tile_rect((int)tile);
+            for (size_t i = 0; i < bin.size(); i++) {
+                rasterize_shaded(shader, tris[bin[i]], clip);
+            }
+        });
+
+        for (size_t i = 0; i < tile_bins.size(); i++) {
+            tile_bins[i].clear();
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef _SHADING_H_
+#define _SHADING_H_
+
+#include "vertex.h"
+#include "simd.h"
+
+#include <cmath>
+
+namespace fbrender {
+
+    /* attributes interpolated across a triangle; along a span every one but invw
+     * is divided by w and the shading kernels receive them perspective-corrected */
+    static const int ATTR_INVW = 0;
+    static const int ATTR_U = 1;
+    static const int ATTR_V = 2;
+    static const int ATTR_R = 3;
+    static const int ATTR_G = 4;
+    static const int ATTR_B = 5;
+    static const int ATTR_WX = 6;
+    static const int ATTR_WY = 7;
+    static const int ATTR_WZ = 8;
+    static const int ATTR_NX = 9;
+    static const int ATTR_NY = 10;
+    static const int ATTR_NZ = 11;
+    static const int ATTR_COUNT = 12;
+
+    /* enough mip levels for textures up to 32768 texels on a side */
+    static const int TEX_MAX_LEVELS = 16;
+
+    /* a texture object; mip level i is max(1, width >> i) by max(1, height >> i)
+     * texels, row by row, and all levels share one block of storage */
+    struct Texture {
+        int width;
+        int height;
+        int level_count;
+        const uint32_t* levels[TEX_MAX_LEVELS];
+        uint32_t* storage;
+    };
+
+    /* the texel of mip level lod nearest to (s, t), clamped to the edges */
+    inline uint32_t texel_nearest(const Texture& tex, int lod, Real s, Real t)
+    {
+        int w = tex.width >> lod, h = tex.height >> lod;
+        if (w < 1) w = 1;
+        if (h < 1) h = 1;
+        Real u = s * (w - 1);
+        Real v = t * (h - 1);
+
+        /* rounded away from zero */
+        int ui = (int)(u < 0 ? std::floor(u) : std::ceil(u));
+        int vi = (int)(v < 0 ? std::floor(v) : std::ceil(v));
+        ui = ui <= 0 ? 0 : ui >= w ? (w - 1) : ui;
+        vi = vi <= 0 ? 0 : vi >= h ? (h - 1) : vi;
+        return tex.levels[lod][vi * w + ui];
+    }
+
+    /*
+     * Features a drawing state enables in the pixel stage. The kernels are
+     * instantiated for every combination and the one matching the state is picked
+     * whenever it changes, so they never test the state per pixel.
+     */
+    static const int SF_COLOR = 0x1;      /* interpolated vertex colors are written */
+    static const int SF_TEXTURE = 0x2;    /* texels are written */
+    static const int SF_LIGHTING = 0x4;   /* per-pixel lighting */
+    static const int SF_MODULATE = 0x8;   /* texels are scaled by the interpolated color */
+    static const int SF_LINEAR = 0x10;    /* texels are filtered bilinearly */
+    static const int SF_LOD_BLEND = 0x20; /* and blended with the next mip level */
+    static const int SF_COUNT = 0x40;
+
+    struct ShadingState;
+    struct SpanSegment;
+
+    /* returns the number of pixels that passed the depth test and were written */
+    typedef int (*ShadeKernel)(const SpanSegment& seg, const ShadingState& st);
+
+    /* everything the pixel stage reads, snapshotted per triangle when binning */
+    struct ShadingState {
+        int drawing_state;
+
+        /* the bound texture, null if it has no image */
+        const Texture* texture;
+        int tex_filter;
+
+        uint32_t foreground;
+
+        Vector4 light_world_pos;
+        /* light colors */
+        Color ambient_color;
+        Color diffuse_color;
+        Color specular_color;
+
+        Color material_ambient;
+        Color material_diffuse;
+        Color material_specular;
+        Color material_emission;
+        Real material_shininess;
+
+        /* derived from the rest by RenderDevice::current_shading_state(): the SF_*
+         * features, the kernel specialized for them and the attributes it reads,
+         * ATTR_INVW first */
+        int features;
+        ShadeKernel kernel;
+        int attr_count;
+        int attrs[ATTR_COUNT];
+    };
+
+    /* a run of pixels on one row whose attributes are affine in x: pixel i of the
+     * run is shaded with start[a] + i * step[a], for first <= i < count. Without
+     * depth_test every pixel is known to pass and the depth buffer is only written.
+     * Textures are sampled from mip level lod, blended with the next level by
+     * lod_blend under TF_LINEAR_MIPMAP_LINEAR */
+    struct SpanSegment {
+        uint32_t* color;
+        Real* depth;
+        int first;
+        int count;
+        const Real* start;
+        const Real* step;
+        bool depth_test;
+        int lod;
+        Real lod_blend;
+    };
+
+    /* the SF_* features of a state; a state that writes no color (neither
+     * DS_COLOR nor DS_TEXTURE_2D with an image) has none and only writes depth */
+    int shade_features(const ShadingState& st);
+
+    /* fills attrs with the attributes read for the given features, ATTR_INVW
+     * first, and returns their number */
+    int shade_attributes(int features, int* attrs);
+
+    /* sets the derived fields of st from the rest, for the kernel at the given
+     * level and color path */
+    void derive_shading_state(ShadingState& st, int level, int color_path);
+
+    /* kernel for the features at the given level and RenderDevice::CP_* color
+     * path, falling back to narrower ones the CPU supports; filtered textures are
+     * only shaded by the float scalar kernel */
+    ShadeKernel select_shade_kernel(int level, int color_path, int features);
+
+    /* pick seg.lod and seg.lod_blend for a mipmapping filter from the
+     * perspective-corrected attributes at the segment start and the gradients of
+     * the attribute planes; without dady only the x direction is considered */
+    void select_texture_lod(SpanSegment& seg, const ShadingState& st, const Real* attr,
+                            const Real* dadx, const Real* dady);
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef _WORKER_POOL_H_
+#define _WORKER_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fbrender {
+
+    /* a fixed set of threads that run the iterations of one job at a time */
+    class WorkerPool {
+    public:
+        /* nthreads counts the calling thread, which takes part in every run() */
+        WorkerPool(int nthreads);
+        ~WorkerPool();
+
+        int size() const { return (int)threads.size() + 1; }
+
+        /* call job(i) for every i in [0, count) and return once all calls are done */
+        void run(size_t count, const std::function<void(size_t)>& job);
+
+    private:
+        std::vector<std::thread> threads;
+        std::mutex lock;
+        std::condition_variable start_cond;
+        std::condition_variable done_cond;
+
+        const std::function<void(size_t)>* current_job;
+        size_t job_count;
+        std::atomic<size_t> next_index;
+        int busy;
+        unsigned generation;
+        bool stopping;
+
+        void worker_main();
+        void work();
+    };
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+namespace fbrender {
+
+    static const int SIMD_NONE = 0;
+    static const int SIMD_SSE41 = 1;
+    static const int SIMD_AVX2 = 2;
+
+    /* the widest instruction set the running CPU supports */
+    int detect_simd_level();
+
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD
+#endif
+
+#endif
@@ -3,12 +3,20 @@
 
 #include "matrix4.h"
 #include "vertex.h"
+#include "vertex_stream.h"
 
 namespace fbrender {
 
     class Transform {
     public:
-        Transform() { }
+        static const int DIRTY_WORLD = 0x1;
+        static const int DIRTY_VIEW = 0x2;
+        static const int DIRTY_PROJECTION = 0x4;
+        static const int DIRTY_LIGHT = 0x8;
+        static const int DIRTY_CAMERA = 0x10;
+        static const int DIRTY_ALL = 0x1f;
+
+        Transform() : dirty(DIRTY_ALL) { }
 
         Transform(Real width, Real height);
 
@@ -19,35 +27,70 @@ namespace fbrender {
         const Matrix4& get_view() const { return view; }
         const Matrix4& get_projection() const { return projection; }
 
+        /* derived values, recomputed lazily when one of their inputs has changed */
+        const Matrix4& get_world_view() { update(); return world_view; }
+        const Matrix4& get_world_view_projection() { update(); return world_view_projection; }
+        const Matrix4& get_normal_matrix() { update(); return normal_matrix; }
+        const Vector4& get_light_world_pos() { update(); return light_world_pos; }
+        const Vector4& get_camera_world_pos() { update(); return camera_world_pos; }
+
         void set_world(const Matrix4& m)
         {
             world = m;
-            update();
+            dirty |= DIRTY_WORLD;
         }
 
         void set_view(const Matrix4& m)
         {
             view = m;
-            update();
+            dirty |= DIRTY_VIEW;
         }
 
         void set_projection(const Matrix4& m)
         {
             projection = m;
+            dirty |= DIRTY_PROJECTION;
+        }
+
+        void set_light_pos(const Vector4& pos)
+        {
+            light_pos = pos;
+            dirty |= DIRTY_LIGHT;
+        }
+
+        void set_camera_pos(const Vector4& pos)
+        {
+            camera_pos = pos;
+            dirty |= DIRTY_CAMERA;
+        }
+
+        void update()
+        {
+            if (dirty) recompute();
         }
 
         Vertex homogenize(const Vertex& v);
 
+        /* the whole per-vertex pipeline (model-view, projection, CVV test and
+         * homogenize) over a structure-of-arrays stream, 8 vertices at a time
+         * where the CPU allows */
+        void transform_stream(const VertexStream& in, const TransformedStream& out);
+
         static int check_cvv(const Vertex& v);
         
     private:
-        Matrix4 world, view, projection, transform;
+        Matrix4 world, view, projection;
+        Matrix4 world_view, world_view_projection, normal_matrix;
+        Vector4 light_pos, light_world_pos;
+        Vector4 camera_pos, camera_world_pos;
         Real height, width;
+        int dirty;
 
-        void update();
+        void recompute();
+        void transform_stream_scalar(const VertexStream& in, const TransformedStream& out, size_t first);
+        void transform_stream_avx2(const VertexStream& in, const TransformedStream& out, size_t count);
     };
 
 }
 
 #endif
-
@@ -61,7 +61,7 @@ namespace fbrender {
     struct TexCoord {
         Real u, v;
 
-        TexCoord(Real u, Real v) : u(u), v(v) { }
+        TexCoord(Real u = 0.0, Real v = 0.0) : u(u), v(v) { }
 
         TexCoord operator*(Real f) const
         {
@@ -86,6 +86,8 @@ namespace fbrender {
         Real invw;
 
     public:
+        Vertex() : invw(0.0) { }
+
         Vertex(Real x, Real y, Real z, Real w, Real u, Real v, Real r, Real g, Real b) 
             : _pos(x, y, z, w), _color(r, g, b), _tex(u, v)
         {
@@ -109,6 +111,7 @@ namespace fbrender {
         const TexCoord& get_texcoord() const { return _tex; }
         const Vector4& get_normal() const { return _normal; }
         const Vector4& get_world_pos() const { return _world_pos; }
+        void set_color(const Color& c) { _color = c; }
         void set_normal(const Vector4& n) { _normal = n; }
         Real get_one_per_w() const { return invw; }
         void set_one_per_w(Real inv) { invw = inv; }
@@ -0,0 +1,56 @@
+#ifndef _VERTEX_STREAM_H_
+#define _VERTEX_STREAM_H_
+
+#include "types.h"
+
+#include <cstddef>
+
+namespace fbrender {
+
+    /* structure-of-arrays vertex input, positions have an implicit w of 1;
+     * normals, texture coordinates and colors may be left null */
+    struct VertexStream {
+        size_t count;
+        const Real* x;
+        const Real* y;
+        const Real* z;
+        const Real* nx;
+        const Real* ny;
+        const Real* nz;
+        const Real* u;
+        const Real* v;
+        const Real* r;
+        const Real* g;
+        const Real* b;
+    };
+
+    /* structure-of-arrays output of Transform::transform_stream, every array must
+     * hold VertexStream::count elements; attributes are divided by clip w the
+     * same way Transform::apply_projection does. Normals are skipped when nx,
+     * ny and nz are null */
+    struct TransformedStream {
+        Real* eye_x;
+        Real* eye_y;
+        Real* eye_z;
+        Real* screen_x;
+        Real* screen_y;
+        Real* screen_z;
+        Real* invw;
+        Real* world_x;
+        Real* world_y;
+        Real* world_z;
+        Real* nx;
+        Real* ny;
+        Real* nz;
+        Real* u;
+        Real* v;
+        Real* r;
+        Real* g;
+        Real* b;
+        /* nonzero when the vertex fails Transform::check_cvv */
+        unsigned char* clipped;
+    };
+
+}
+
+#endif
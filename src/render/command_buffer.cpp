@@ -0,0 +1,165 @@
+#include "render/command_buffer.h"
+#include "render/render_device.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace fbrender {
+
+    static bool same_matrix(const Matrix4& a, const Matrix4& b)
+    {
+        for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) {
+                if (a[i][j] != b[i][j]) return false;
+            }
+        }
+        return true;
+    }
+
+    static bool same_color(const Color& a, const Color& b)
+    {
+        return a.r == b.r && a.g == b.g && a.b == b.b;
+    }
+
+    bool CommandBuffer::StateBlock::operator==(const StateBlock& s) const
+    {
+        return drawing_state == s.drawing_state && texture == s.texture && tex_filter == s.tex_filter &&
+               same_color(material_ambient, s.material_ambient) &&
+               same_color(material_diffuse, s.material_diffuse) &&
+               same_color(material_specular, s.material_specular) &&
+               same_color(material_emission, s.material_emission) &&
+               material_shininess == s.material_shininess;
+    }
+
+    CommandBuffer::CommandBuffer()
+    {
+        reset();
+    }
+
+    void CommandBuffer::reset()
+    {
+        current.drawing_state = 0;
+        current.texture = 0;
+        current.tex_filter = RenderDevice::TF_NEAREST;
+        current.material_ambient = current.material_diffuse = Color();
+        current.material_specular = current.material_emission = Color();
+        current.material_shininess = 0;
+        current_world = Matrix4::IDENTITY;
+        state_changed = world_changed = true;
+
+        states.clear();
+        worlds.clear();
+        draws.clear();
+        order.clear();
+        sorted = false;
+    }
+
+    void CommandBuffer::set_world(const Matrix4& mat) { current_world = mat; world_changed = true; }
+    void CommandBuffer::enable(int state) { current.drawing_state |= state; state_changed = true; }
+    void CommandBuffer::disable(int state) { current.drawing_state &= ~state; state_changed = true; }
+    void CommandBuffer::bind_texture(int name) { current.texture = name; state_changed = true; }
+    void CommandBuffer::set_texture_filter(int filter) { current.tex_filter = filter; state_changed = true; }
+
+    void CommandBuffer::set_material_ambient(const Color& amb) { current.material_ambient = amb; state_changed = true; }
+    void CommandBuffer::set_material_diffuse(const Color& diff) { current.material_diffuse = diff; state_changed = true; }
+    void CommandBuffer::set_material_specular(const Color& spec) { current.material_specular = spec; state_changed = true; }
+    void CommandBuffer::set_material_emission(const Color& emi) { current.material_emission = emi; state_changed = true; }
+    void CommandBuffer::set_shininess(Real shi) { current.material_shininess = shi; state_changed = true; }
+
+    void CommandBuffer::draw_indexed(const Vertex* verts, size_t nverts, const uint32_t* indices, size_t nidx)
+    {
+        if (nverts == 0 || nidx < 3) return;
+
+        if (state_changed && (states.empty() || !(states.back() == current))) states.push_back(current);
+        if (world_changed && (worlds.empty() || !same_matrix(worlds.back(), current_world))) worlds.push_back(current_world);
+        state_changed = world_changed = false;
+
+        /* the bounds are taken once here, the depth of a draw only needs its center */
+        Vector4 lo = verts[0].get_pos(), hi = lo;
+        for (size_t i = 1; i < nverts; i++) {
+            const Vector4& p = verts[i].get_pos();
+            lo.x = std::min(lo.x, p.x);
+            lo.y = std::min(lo.y, p.y);
+            lo.z = std::min(lo.z, p.z);
+            hi.x = std::max(hi.x, p.x);
+            hi.y = std::max(hi.y, p.y);
+            hi.z = std::max(hi.z, p.z);
+        }
+
+        Draw d;
+        d.state = (uint32_t)states.size() - 1;
+        d.world = (uint32_t)worlds.size() - 1;
+        d.verts = verts;
+        d.nverts = nverts;
+        d.indices = indices;
+        d.nidx = nidx;
+        d.center = Vector4((lo.x + hi.x) * (Real)0.5, (lo.y + hi.y) * (Real)0.5, (lo.z + hi.z) * (Real)0.5, 1);
+        draws.push_back(d);
+
+        sorted = false;
+    }
+
+    static bool color_less(const Color& a, const Color& b)
+    {
+        if (a.r != b.r) return a.r < b.r;
+        if (a.g != b.g) return a.g < b.g;
+        return a.b < b.b;
+    }
+
+    bool CommandBuffer::state_less(const StateBlock& a, const StateBlock& b)
+    {
+        if (a.texture != b.texture) return a.texture < b.texture;
+        if (a.drawing_state != b.drawing_state) return a.drawing_state < b.drawing_state;
+        if (a.tex_filter != b.tex_filter) return a.tex_filter < b.tex_filter;
+        if (!same_color(a.material_ambient, b.material_ambient)) return color_less(a.material_ambient, b.material_ambient);
+        if (!same_color(a.material_diffuse, b.material_diffuse)) return color_less(a.material_diffuse, b.material_diffuse);
+        if (!same_color(a.material_specular, b.material_specular)) return color_less(a.material_specular, b.material_specular);
+        if (!same_color(a.material_emission, b.material_emission)) return color_less(a.material_emission, b.material_emission);
+        return a.material_shininess < b.material_shininess;
+    }
+
+    void CommandBuffer::sort(const Matrix4& view_projection)
+    {
+        if (sorted && same_matrix(view_projection, sorted_view_projection)) return;
+
+        /* rank the states, equal blocks recorded apart share a rank */
+        std::vector<uint32_t> by_state(states.size());
+        for (size_t i = 0; i < states.size(); i++) by_state[i] = (uint32_t)i;
+        std::sort(by_state.begin(), by_state.end(), [&](uint32_t a, uint32_t b) {
+            return state_less(states[a], states[b]);
+        });
+        std::vector<uint32_t> rank(states.size());
+        for (size_t i = 0; i < by_state.size(); i++) {
+            bool same = i > 0 && states[by_state[i]] == states[by_state[i - 1]];
+            rank[by_state[i]] = i == 0 ? 0 : rank[by_state[i - 1]] + (same ? 0 : 1);
+        }
+
+        /* clip w grows with the distance in front of the camera, centers behind it go last */
+        std::vector<Real> depth(draws.size());
+        for (size_t i = 0; i < draws.size(); i++) {
+            const Draw& d = draws[i];
+            Real w = (d.center * worlds[d.world] * view_projection).w;
+            depth[i] = w > 0 ? w : std::numeric_limits<Real>::max();
+        }
+
+        /* lines write no depth, so whatever is drawn after one can cover it: each
+         * wireframe draw stays in place and only the runs of filled draws between
+         * them are sorted */
+        order.clear();
+        for (size_t i = 0; i < draws.size(); i++) {
+            size_t run = order.size();
+            while (i < draws.size() && !(states[draws[i].state].drawing_state & RenderDevice::DS_WIREFRAME)) {
+                order.push_back((uint32_t)i++);
+            }
+            std::stable_sort(order.begin() + run, order.end(), [&](uint32_t a, uint32_t b) {
+                uint32_t ra = rank[draws[a].state], rb = rank[draws[b].state];
+                if (ra != rb) return ra < rb;
+                return depth[a] < depth[b];
+            });
+            if (i < draws.size()) order.push_back((uint32_t)i);
+        }
+
+        sorted_view_projection = view_projection;
+        sorted = true;
+    }
+}
@@ -11,42 +11,186 @@
 
 namespace fbrender {
 
-    FBRenderDevice::FBRenderDevice(const char* filename)
+    FBRenderDevice::FBRenderDevice(const char* filename, int mode)
     {
         fbp = nullptr;
+        screen = nullptr;
+        fptr = -1;
+        flipping = false;
+        paged = false;
+        pan_lost = false;
+        vsync = false;
         int fd = open(filename, O_RDWR);
 
         struct fb_fix_screeninfo finfo;
-        struct fb_var_screeninfo vinfo;
 
         if (fd < 0) return;
-        if (ioctl(fd, FBIOGET_FSCREENINFO, &finfo)) return;
-        if (ioctl(fd, FBIOGET_VSCREENINFO, &vinfo)) return;
+        if (ioctl(fd, FBIOGET_FSCREENINFO, &finfo) || ioctl(fd, FBIOGET_VSCREENINFO, &vinfo)) {
+            close(fd);
+            return;
+        }
+
+        fptr = fd;
+        saved_vinfo = vinfo;
+        line_length = finfo.line_length;
+
+        PixelFormat format;
+        format.bytes_per_pixel = (vinfo.bits_per_pixel + 7) / 8;
+        format.red_offset = vinfo.red.offset;
+        format.red_length = vinfo.red.length;
+        format.green_offset = vinfo.green.offset;
+        format.green_length = vinfo.green.length;
+        format.blue_offset = vinfo.blue.offset;
+        format.blue_length = vinfo.blue.length;
+        format.alpha_offset = vinfo.transp.offset;
+        format.alpha_length = vinfo.transp.length;
+        converter = make_pixel_converter(format, detect_simd_level());
 
-        screensize = vinfo.xres * vinfo.yres * vinfo.bits_per_pixel / 8;
+        if (mode == PM_FLIP && enable_flipping(finfo)) {
+            init(vinfo.xres, vinfo.yres);
+
+            /* the first page is on display, draw into the second */
+            char* page = fbp + line_length * vinfo.yres;
+            set_color_buffers((uint32_t*)page, (uint32_t*)fbp, line_length / sizeof(uint32_t));
+            return;
+        }
+
+        screensize = line_length * vinfo.yres;
         char* framebuffer = (char *) mmap (0, screensize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0); 
 
         if (framebuffer == MAP_FAILED) {
-            close(fd);
             return;
         }
 
-        fptr = fd;
         fbp = framebuffer;
+        screen = framebuffer;
         init(vinfo.xres, vinfo.yres);
     }
 
     FBRenderDevice::~FBRenderDevice()
     {
+        /* the presenter thread calls back into this device */
+        set_swap_mode(SM_SYNC);
+
         if (fbp) {
             munmap(fbp, screensize);
         }
-        if (fptr > 0) close(fptr);
+        if (paged) {
+            ioctl(fptr, FBIOPUT_VSCREENINFO, &saved_vinfo);
+        }
+        if (fptr >= 0) close(fptr);
+    }
+
+    bool FBRenderDevice::enable_flipping(const struct fb_fix_screeninfo& finfo)
+    {
+        /* pages are rendered into directly, so they must hold XRGB8888 */
+        PixelFormat opaque = converter.format;
+        opaque.alpha_offset = opaque.alpha_length = 0;
+        if (!(opaque == PF_XRGB8888) || finfo.line_length % sizeof(uint32_t)) {
+            return false;
+        }
+
+        struct fb_var_screeninfo v = vinfo;
+        v.yres_virtual = v.yres * 2;
+        v.xoffset = v.yoffset = 0;
+
+        struct fb_fix_screeninfo f;
+        if (ioctl(fptr, FBIOPUT_VSCREENINFO, &v) || ioctl(fptr, FBIOGET_VSCREENINFO, &v) ||
+            ioctl(fptr, FBIOGET_FSCREENINFO, &f) || v.yres_virtual < v.yres * 2 ||
+            (size_t)f.line_length * v.yres * 2 > f.smem_len || f.line_length % sizeof(uint32_t)) {
+            ioctl(fptr, FBIOPUT_VSCREENINFO, &saved_vinfo);
+            return false;
+        }
+
+        long size = (long)f.line_length * v.yres * 2;
+        char* framebuffer = (char *) mmap (0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fptr, 0);
+        if (framebuffer == MAP_FAILED) {
+            ioctl(fptr, FBIOPUT_VSCREENINFO, &saved_vinfo);
+            return false;
+        }
+
+        /* some drivers accept the virtual size but can't pan */
+        if (ioctl(fptr, FBIOPAN_DISPLAY, &v)) {
+            munmap(framebuffer, size);
+            ioctl(fptr, FBIOPUT_VSCREENINFO, &saved_vinfo);
+            return false;
+        }
+
+        vinfo = v;
+        line_length = f.line_length;
+        screensize = size;
+        fbp = framebuffer;
+        screen = framebuffer;
+        flipping = true;
+        paged = true;
+        return true;
     }
 
-    void FBRenderDevice::copy_buffer(const void* buffer, size_t size)
+    void FBRenderDevice::copy_buffer(const void* buffer, size_t pitch)
     {
-        memcpy(fbp, buffer, size);
+        if (flipping) {
+            /* buffer is one of the pages, show it */
+            unsigned int shown = vinfo.yoffset;
+            vinfo.yoffset = ((const char*)buffer - fbp) / line_length;
+            if (ioctl(fptr, FBIOPAN_DISPLAY, &vinfo) == 0) {
+                /* the page that was shown is drawn into next, and may be scanned
+                 * out until the pan takes effect at the next vertical blank */
+                __u32 crtc = 0;
+                if (vsync && ioctl(fptr, FBIO_WAITFORVSYNC, &crtc)) vsync = false;
+                return;
+            }
+
+            /* the driver stopped panning: copy into the page on display, which
+             * buffer isn't, and from the next frame on render off-screen and
+             * copy as PM_COPY does, see frame_swapped() */
+            vinfo.yoffset = shown;
+            screen = fbp + shown * line_length;
+            memcpy(screen, buffer, line_length * vinfo.yres);
+            flipping = false;
+            pan_lost = true;
+            return;
+        }
+
+        const char* src = (const char*)buffer;
+        char* dst = screen;
+        for (int i = 0; i < get_height(); i++) {
+            converter.convert(dst, (const uint32_t*)src, get_width());
+            src += pitch;
+            dst += line_length;
+        }
     }
-}
 
+    void FBRenderDevice::copy_rect(const void* buffer, size_t pitch, int x, int y, int w, int h)
+    {
+        const char* src = (const char*)buffer + y * pitch + x * sizeof(uint32_t);
+        char* dst = screen + y * line_length + x * converter.format.bytes_per_pixel;
+        for (int i = 0; i < h; i++) {
+            converter.convert(dst, (const uint32_t*)src, w);
+            src += pitch;
+            dst += line_length;
+        }
+    }
+
+    void FBRenderDevice::fill_rect(int x, int y, int w, int h, uint32_t color)
+    {
+        /* convert one row in memory and replicate it, video memory is slow to read */
+        size_t bytes = w * converter.format.bytes_per_pixel;
+        fill_row.assign(w, color);
+        fill_bytes.resize(bytes);
+        converter.convert(fill_bytes.data(), fill_row.data(), w);
+
+        char* dst = screen + y * line_length + x * converter.format.bytes_per_pixel;
+        for (int i = 0; i < h; i++) {
+            memcpy(dst, fill_bytes.data(), bytes);
+            dst += line_length;
+        }
+    }
+
+    void FBRenderDevice::frame_swapped()
+    {
+        /* the next frame would be drawn into the page on display */
+        if (!pan_lost) return;
+        pan_lost = false;
+        set_color_buffers(nullptr, nullptr, 0);
+    }
+}
@@ -0,0 +1,106 @@
+#include "render/frame_presenter.h"
+
+namespace fbrender {
+
+    FramePresenter::FramePresenter(int nbuffers, int rendering, int policy,
+                                   const std::function<void(int)>& present)
+        : present(present), policy(policy)
+    {
+        pending = -1;
+        free_mask = ((1u << nbuffers) - 1) & ~(1u << rendering);
+        queued = 0;
+        presented = 0;
+        dropped = 0;
+        busy = false;
+        stopping = false;
+
+        thread = std::thread(&FramePresenter::presenter_main, this);
+    }
+
+    FramePresenter::~FramePresenter()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        cond.notify_all();
+        thread.join();
+    }
+
+    void FramePresenter::wake()
+    {
+        /* the other side checks its condition under the lock, taking it once
+         * after the atomic update makes sure the wakeup is not lost */
+        {
+            std::lock_guard<std::mutex> guard(lock);
+        }
+        cond.notify_all();
+    }
+
+    int FramePresenter::submit(int buffer)
+    {
+        if (policy == FP_QUEUE) {
+            std::unique_lock<std::mutex> guard(lock);
+            cond.wait(guard, [this] { return pending < 0; });
+        }
+
+        queued++;
+        int replaced = pending.exchange(buffer);
+        wake();
+
+        if (replaced >= 0) {
+            /* the presenter never saw it, render straight into it again */
+            dropped++;
+            return replaced;
+        }
+        return take_free();
+    }
+
+    int FramePresenter::take_free()
+    {
+        for (;;) {
+            unsigned mask = free_mask;
+            if (mask == 0) {
+                /* only possible with fewer than three buffers */
+                std::unique_lock<std::mutex> guard(lock);
+                cond.wait(guard, [this] { return free_mask != 0; });
+                continue;
+            }
+
+            int buffer = __builtin_ctz(mask);
+            if (free_mask.compare_exchange_weak(mask, mask & ~(1u << buffer))) return buffer;
+        }
+    }
+
+    void FramePresenter::drain()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        cond.wait(guard, [this] { return pending < 0 && !busy; });
+    }
+
+    void FramePresenter::presenter_main()
+    {
+        for (;;) {
+            int buffer;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                cond.wait(guard, [this] { return stopping || pending >= 0; });
+                buffer = pending.exchange(-1);
+                if (buffer < 0) return;
+                busy = true;
+            }
+            /* the pending slot is free again */
+            cond.notify_all();
+
+            present(buffer);
+            presented++;
+            free_mask |= 1u << buffer;
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                busy = false;
+            }
+            cond.notify_all();
+        }
+    }
+}
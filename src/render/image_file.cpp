@@ -0,0 +1,52 @@
+#include "render/image_file.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+namespace fbrender {
+
+    std::string image_header(int type, int width, int height)
+    {
+        char header[128];
+        if (type == IF_PAM) {
+            snprintf(header, sizeof(header),
+                     "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", width, height);
+        } else {
+            snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+        }
+        return header;
+    }
+
+    PixelFormat image_format(int type)
+    {
+        /* both store red, green, blue (and alpha) bytes in that order */
+        return type == IF_PAM ? PF_ABGR8888 : PF_BGR888;
+    }
+
+    bool write_image(const char* filename, int type, const uint32_t* pixels, int width, int height, size_t pitch)
+    {
+        FILE* file = fopen(filename, "wb");
+        if (!file) return false;
+
+        std::string header = image_header(type, width, height);
+        bool ok = fwrite(header.data(), 1, header.size(), file) == header.size();
+
+        /* convert a batch of rows at a time and write it in one go */
+        PixelConverter converter = make_pixel_converter(image_format(type), detect_simd_level());
+        size_t row_bytes = (size_t)width * converter.format.bytes_per_pixel;
+        int batch = std::max(1, (int)((256 << 10) / std::max<size_t>(row_bytes, 1)));
+        std::vector<unsigned char> rows(row_bytes * std::min(batch, height));
+
+        for (int y = 0; ok && y < height; y += batch) {
+            int n = std::min(batch, height - y);
+            for (int i = 0; i < n; i++) {
+                const uint32_t* src = (const uint32_t*)((const char*)pixels + (y + i) * pitch);
+                converter.convert(&rows[i * row_bytes], src, width);
+            }
+            ok = fwrite(rows.data(), 1, n * row_bytes, file) == n * row_bytes;
+        }
+
+        return fclose(file) == 0 && ok;
+    }
+}
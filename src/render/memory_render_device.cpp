@@ -0,0 +1,88 @@
+#include "render/memory_render_device.h"
+#include "render/image_file.h"
+
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+namespace fbrender {
+
+    MemoryRenderDevice::MemoryRenderDevice(int width, int height, void* pixels, size_t pitch,
+                                           const PixelFormat& format)
+    {
+        this->pixels = (char*)pixels;
+        this->pitch = pitch;
+        converter = make_pixel_converter(format, detect_simd_level());
+        file_map = nullptr;
+        file_size = 0;
+
+        init(width, height);
+    }
+
+    MemoryRenderDevice::MemoryRenderDevice(const char* filename, int width, int height, int type)
+    {
+        pixels = nullptr;
+        converter = make_pixel_converter(image_format(type), detect_simd_level());
+        pitch = (size_t)width * converter.format.bytes_per_pixel;
+        file_map = nullptr;
+
+        std::string header = image_header(type, width, height);
+        file_size = header.size() + pitch * height;
+
+        int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return;
+
+        if (ftruncate(fd, file_size) == 0) {
+            char* map = (char *) mmap (0, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED) file_map = map;
+        }
+        /* the mapping stays valid without the descriptor */
+        close(fd);
+
+        if (!file_map) return;
+
+        memcpy(file_map, header.data(), header.size());
+        pixels = file_map + header.size();
+        init(width, height);
+    }
+
+    MemoryRenderDevice::~MemoryRenderDevice()
+    {
+        /* the presenter thread calls back into this device */
+        set_swap_mode(SM_SYNC);
+
+        if (file_map) munmap(file_map, file_size);
+    }
+
+    void MemoryRenderDevice::copy_buffer(const void* buffer, size_t pitch)
+    {
+        copy_rect(buffer, pitch, 0, 0, get_width(), get_height());
+    }
+
+    void MemoryRenderDevice::copy_rect(const void* buffer, size_t pitch, int x, int y, int w, int h)
+    {
+        const char* src = (const char*)buffer + y * pitch + x * sizeof(uint32_t);
+        char* dst = pixels + y * this->pitch + x * converter.format.bytes_per_pixel;
+        for (int i = 0; i < h; i++) {
+            converter.convert(dst, (const uint32_t*)src, w);
+            src += pitch;
+            dst += this->pitch;
+        }
+    }
+
+    void MemoryRenderDevice::fill_rect(int x, int y, int w, int h, uint32_t color)
+    {
+        size_t bytes = w * converter.format.bytes_per_pixel;
+        fill_row.assign(w, color);
+        fill_bytes.resize(bytes);
+        converter.convert(fill_bytes.data(), fill_row.data(), w);
+
+        char* dst = pixels + y * pitch + x * converter.format.bytes_per_pixel;
+        for (int i = 0; i < h; i++) {
+            memcpy(dst, fill_bytes.data(), bytes);
+            dst += pitch;
+        }
+    }
+}
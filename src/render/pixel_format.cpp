@@ -0,0 +1,229 @@
+#include "render/pixel_format.h"
+
+#include <cstring>
+#include <cstdint>
+
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace fbrender {
+
+    bool operator==(const PixelFormat& a, const PixelFormat& b)
+    {
+        return a.bytes_per_pixel == b.bytes_per_pixel &&
+               a.red_offset == b.red_offset && a.red_length == b.red_length &&
+               a.green_offset == b.green_offset && a.green_length == b.green_length &&
+               a.blue_offset == b.blue_offset && a.blue_length == b.blue_length &&
+               a.alpha_offset == b.alpha_offset && a.alpha_length == b.alpha_length;
+    }
+
+/* top length bits of an 8-bit channel value, moved to offset */
+#define CHANNEL(v, offset, length) \
+        ((length) >= 8 ? (v) << ((offset) + (length) - 8) : ((v) >> (8 - (length))) << (offset))
+
+    static inline uint32_t pack_pixel(const PixelConverter& pc, uint32_t c)
+    {
+        const PixelFormat& f = pc.format;
+        uint32_t r = (c >> 16) & 0xff;
+        uint32_t g = (c >> 8) & 0xff;
+        uint32_t b = c & 0xff;
+        return CHANNEL(r, f.red_offset, f.red_length) |
+               CHANNEL(g, f.green_offset, f.green_length) |
+               CHANNEL(b, f.blue_offset, f.blue_length) | pc.alpha;
+    }
+
+    /* any format, one pixel at a time */
+    static void convert_generic(const PixelConverter& pc, void* dst, const uint32_t* src, int count)
+    {
+        const int bpp = pc.format.bytes_per_pixel;
+        unsigned char* d = (unsigned char*)dst;
+
+        for (int i = 0; i < count; i++, d += bpp) {
+            uint32_t p = pack_pixel(pc, src[i]);
+            for (int b = 0; b < bpp; b++) {
+                d[b] = (unsigned char)(p >> (8 * b));
+            }
+        }
+    }
+
+    static void convert_copy(const PixelConverter& /* pc */, void* dst, const uint32_t* src, int count)
+    {
+        memcpy(dst, src, count * sizeof(uint32_t));
+    }
+
+#ifdef HAVE_X86_SIMD
+
+    /* 8-bit channels on byte boundaries, 4 bytes per pixel */
+    __attribute__((target("sse4.1")))
+    static void convert_shuffle32_sse41(const PixelConverter& pc, void* dst, const uint32_t* src, int count)
+    {
+        const __m128i mask = _mm_loadu_si128((const __m128i*)pc.shuffle);
+        const __m128i alpha = _mm_set1_epi32((int)pc.alpha);
+        uint32_t* d = (uint32_t*)dst;
+        int i;
+
+        for (i = 0; i + 4 <= count; i += 4) {
+            __m128i p = _mm_loadu_si128((const __m128i*)(src + i));
+            _mm_storeu_si128((__m128i*)(d + i), _mm_or_si128(_mm_shuffle_epi8(p, mask), alpha));
+        }
+
+        convert_generic(pc, d + i, src + i, count - i);
+    }
+
+    /* 8-bit channels on byte boundaries, 3 bytes per pixel: 4 pixels make 12
+     * bytes, the 4 bytes each store writes past them are overwritten by the next */
+    __attribute__((target("sse4.1")))
+    static void convert_shuffle24_sse41(const PixelConverter& pc, void* dst, const uint32_t* src, int count)
+    {
+        const __m128i mask = _mm_loadu_si128((const __m128i*)pc.shuffle);
+        const __m128i alpha = _mm_set1_epi32((int)pc.alpha);
+        unsigned char* d = (unsigned char*)dst;
+        int i;
+
+        for (i = 0; i + 6 <= count; i += 4) {
+            __m128i p = _mm_loadu_si128((const __m128i*)(src + i));
+            _mm_storeu_si128((__m128i*)(d + 3 * i), _mm_or_si128(_mm_shuffle_epi8(p, mask), alpha));
+        }
+
+        convert_generic(pc, d + 3 * i, src + i, count - i);
+    }
+
+#define PACK16_SETUP(ch) \
+        const __m128i ch##_shift = _mm_cvtsi32_si128(ch##_source + 8 - f.ch##_length); \
+        const __m128i ch##_offset = _mm_cvtsi32_si128(f.ch##_offset)
+
+    /* 2 bytes per pixel, channels no wider than 8 bits */
+    __attribute__((target("sse4.1")))
+    static void convert_pack16_sse41(const PixelConverter& pc, void* dst, const uint32_t* src, int count)
+    {
+        const PixelFormat& f = pc.format;
+        const int red_source = 16, green_source = 8, blue_source = 0;
+        PACK16_SETUP(red);
+        PACK16_SETUP(green);
+        PACK16_SETUP(blue);
+        const __m128i red_mask = _mm_set1_epi32((1 << f.red_length) - 1);
+        const __m128i green_mask = _mm_set1_epi32((1 << f.green_length) - 1);
+        const __m128i blue_mask = _mm_set1_epi32((1 << f.blue_length) - 1);
+        const __m128i alpha = _mm_set1_epi32((int)pc.alpha);
+        uint16_t* d = (uint16_t*)dst;
+        int i;
+
+#define PACK(p) \
+        _mm_or_si128(_mm_or_si128( \
+            _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(p, red_shift), red_mask), red_offset), \
+            _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(p, green_shift), green_mask), green_offset)), \
+            _mm_or_si128(_mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(p, blue_shift), blue_mask), blue_offset), alpha))
+
+        for (i = 0; i + 8 <= count; i += 8) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 4));
+            _mm_storeu_si128((__m128i*)(d + i), _mm_packus_epi32(PACK(a), PACK(b)));
+        }
+#undef PACK
+
+        convert_generic(pc, d + i, src + i, count - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void convert_shuffle32_avx2(const PixelConverter& pc, void* dst, const uint32_t* src, int count)
+    {
+        const __m256i mask = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)pc.shuffle));
+        const __m256i alpha = _mm256_set1_epi32((int)pc.alpha);
+        uint32_t* d = (uint32_t*)dst;
+        int i;
+
+        for (i = 0; i + 8 <= count; i += 8) {
+            __m256i p = _mm256_loadu_si256((const __m256i*)(src + i));
+            _mm256_storeu_si256((__m256i*)(d + i), _mm256_or_si256(_mm256_shuffle_epi8(p, mask), alpha));
+        }
+
+        convert_generic(pc, d + i, src + i, count - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void convert_pack16_avx2(const PixelConverter& pc, void* dst, const uint32_t* src, int count)
+    {
+        const PixelFormat& f = pc.format;
+        const int red_source = 16, green_source = 8, blue_source = 0;
+        PACK16_SETUP(red);
+        PACK16_SETUP(green);
+        PACK16_SETUP(blue);
+        const __m256i red_mask = _mm256_set1_epi32((1 << f.red_length) - 1);
+        const __m256i green_mask = _mm256_set1_epi32((1 << f.green_length) - 1);
+        const __m256i blue_mask = _mm256_set1_epi32((1 << f.blue_length) - 1);
+        const __m256i alpha = _mm256_set1_epi32((int)pc.alpha);
+        uint16_t* d = (uint16_t*)dst;
+        int i;
+
+#define PACK(p) \
+        _mm256_or_si256(_mm256_or_si256( \
+            _mm256_sll_epi32(_mm256_and_si256(_mm256_srl_epi32(p, red_shift), red_mask), red_offset), \
+            _mm256_sll_epi32(_mm256_and_si256(_mm256_srl_epi32(p, green_shift), green_mask), green_offset)), \
+            _mm256_or_si256(_mm256_sll_epi32(_mm256_and_si256(_mm256_srl_epi32(p, blue_shift), blue_mask), blue_offset), alpha))
+
+        for (i = 0; i + 16 <= count; i += 16) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(src + i));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(src + i + 8));
+            /* packing works within 128-bit lanes, put the quarters back in order */
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(PACK(a), PACK(b)), 0xd8);
+            _mm256_storeu_si256((__m256i*)(d + i), packed);
+        }
+#undef PACK
+
+        convert_generic(pc, d + i, src + i, count - i);
+    }
+#undef PACK16_SETUP
+
+#endif
+
+    PixelConverter make_pixel_converter(const PixelFormat& format, int level)
+    {
+        PixelConverter pc;
+        pc.format = format;
+        pc.alpha = format.alpha_length > 0 ? ((1u << format.alpha_length) - 1) << format.alpha_offset : 0;
+        pc.kernel = convert_generic;
+        memset(pc.shuffle, 0x80, sizeof(pc.shuffle));
+
+        if (format == PF_XRGB8888) {
+            pc.kernel = convert_copy;
+            return pc;
+        }
+
+        const int bpp = format.bytes_per_pixel;
+        const bool byte_channels =
+            format.red_length == 8 && format.green_length == 8 && format.blue_length == 8 &&
+            format.red_offset % 8 == 0 && format.green_offset % 8 == 0 && format.blue_offset % 8 == 0 &&
+            format.red_offset / 8 < bpp && format.green_offset / 8 < bpp && format.blue_offset / 8 < bpp;
+        const bool narrow_channels = bpp == 2 &&
+            format.red_length <= 8 && format.green_length <= 8 && format.blue_length <= 8 &&
+            format.red_offset + format.red_length <= 16 && format.green_offset + format.green_length <= 16 &&
+            format.blue_offset + format.blue_length <= 16 && format.alpha_offset + format.alpha_length <= 16;
+
+        /* for 4 pixels, the source byte of every destination byte */
+        if (byte_channels && (bpp == 3 || bpp == 4)) {
+            for (int k = 0; k < 4; k++) {
+                pc.shuffle[k * bpp + format.red_offset / 8] = (unsigned char)(k * 4 + 2);
+                pc.shuffle[k * bpp + format.green_offset / 8] = (unsigned char)(k * 4 + 1);
+                pc.shuffle[k * bpp + format.blue_offset / 8] = (unsigned char)(k * 4);
+            }
+        }
+
+#ifdef HAVE_X86_SIMD
+        int supported = detect_simd_level();
+        if (level > supported) level = supported;
+
+        if (level >= SIMD_AVX2) {
+            if (byte_channels && bpp == 4) pc.kernel = convert_shuffle32_avx2;
+            else if (byte_channels && bpp == 3 && !pc.alpha) pc.kernel = convert_shuffle24_sse41;
+            else if (narrow_channels) pc.kernel = convert_pack16_avx2;
+        } else if (level >= SIMD_SSE41) {
+            if (byte_channels && bpp == 4) pc.kernel = convert_shuffle32_sse41;
+            else if (byte_channels && bpp == 3 && !pc.alpha) pc.kernel = convert_shuffle24_sse41;
+            else if (narrow_channels) pc.kernel = convert_pack16_sse41;
+        }
+#endif
+
+        return pc;
+    }
+}
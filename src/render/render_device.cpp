@@ -1,85 +1,306 @@
 #include "render/render_device.h"
+#include "render/shader.h"
+#include "render/worker_pool.h"
+#include "render/frame_presenter.h"
+#include "render/command_buffer.h"
 
 #include <vector>
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
 #include <sys/mman.h>
 #include <iostream>
 using namespace std;
 
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 namespace fbrender {
-    
+
+    /*
+     * Fill a w x h rectangle of 32-bit words whose rows start pitch words apart.
+     * The rectangle is about to be sent to the output rather than drawn into, so
+     * the x86 path writes with non-temporal stores that bypass the cache instead
+     * of evicting useful data.
+     */
+#ifdef HAVE_X86_SIMD
+    __attribute__((target("sse2")))
+    static void fill_buffer(uint32_t* dst, size_t pitch, int w, int h, uint32_t value)
+    {
+        __m128i v = _mm_set1_epi32((int)value);
+        for (int y = 0; y < h; y++) {
+            uint32_t* row = dst + y * pitch;
+            int x = 0;
+            /* rows of buffers supplied by the device needn't be aligned */
+            for (; x < w && ((uintptr_t)(row + x) & 15); x++) {
+                row[x] = value;
+            }
+            for (; x + 4 <= w; x += 4) {
+                _mm_stream_si128((__m128i*)(row + x), v);
+            }
+            for (; x < w; x++) {
+                row[x] = value;
+            }
+        }
+        _mm_sfence();
+    }
+#else
+    static void fill_buffer(uint32_t* dst, size_t pitch, int w, int h, uint32_t value)
+    {
+        for (int y = 0; y < h; y++) {
+            std::fill(dst + y * pitch, dst + y * pitch + w, value);
+        }
+    }
+#endif
+
     void RenderDevice::init(int width, int height)
     {
+        stop_presenter();
+
         /* allocate framebuffer and z-buffer */
-        framebuffer_size = height * width * sizeof(uint32_t);
+        pitch = aligned_pitch(width);
 
-        delete framebuffer[0];
-        delete framebuffer[1];
-        delete [] pixel_buffer;
-        delete [] zbuffer;
+        if (pixel_buffer) munmap(pixel_buffer, framebuffer_size * BUFFER_COUNT);
 
-        framebuffer[0] = new uint32_t*[height];
-        framebuffer[1] = new uint32_t*[height];
-        zbuffer = new Real*[height];
+        framebuffer_size = height * pitch * sizeof(uint32_t);
 
-        pixel_buffer = (uint32_t *) mmap (0, framebuffer_size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0); 
+        /* mmap returns page aligned memory, and framebuffer_size is a multiple of
+         * BUFFER_ALIGNMENT, so all color buffers are aligned. The third buffer is
+         * only used outside SM_SYNC, until then its pages are never touched */
+        pixel_buffer = (uint32_t *) mmap (0, framebuffer_size * BUFFER_COUNT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0); 
         if (pixel_buffer == MAP_FAILED) {
             pixel_buffer = nullptr;
         }
-
-        char* pfb = (char*) pixel_buffer;
-        for (int i = 0; i < height; i++) {
-            framebuffer[0][i] = (uint32_t*)(pfb + width * sizeof(uint32_t) * i);
-            zbuffer[i] = new Real[width]();
-        }
-        pfb += framebuffer_size;
-        for (int i = 0; i < height; i++) {
-            framebuffer[1][i] = (uint32_t*)(pfb + width * sizeof(uint32_t) * i);
+        for (int i = 0; i < BUFFER_COUNT; i++) {
+            framebuffer[i] = pixel_buffer ? pixel_buffer + i * height * pitch : nullptr;
         }
 
         buffer_index = 0;
+        spare_buffer = 1;
+        swap_mode = SM_SYNC;
+        present_totals.queued = present_totals.presented = present_totals.dropped = 0;
 
         this->width = width;
         this->height = height;
+        allocate_zbuffer();
 
         transform = Transform(width, height);
         background = 0;
-        foreground = 0xffffffff;
+        shading.foreground = 0xffffffff;
 
         /* lighting parameter */
-        light_pos = {50, 0, 0};
+        transform.set_light_pos({50, 0, 0});
 
         /* texture parameter */
-        tex_filter = TF_NEAREST;
+        shading.tex_filter = TF_NEAREST;
+
+        raster_mode = RM_SCANLINE;
+        subspan_length = 16;
+        simd_level = detect_simd_level();
+        color_path = CP_FLOAT;
+
+        shading.drawing_state = 0;
+        shading_dirty = true;
+        snapshot_stale = true;
+
+        tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+        tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+        tile_bins.assign(tiles_x * tiles_y, std::vector<uint32_t>());
+        discard_bins();
+
+        /* the depth buffer starts out uninitialized and is cleared lazily */
+        for (int i = 0; i < BUFFER_COUNT; i++) {
+            color_cleared[i].assign(tiles_x * tiles_y, 1);
+            clear_value[i] = background;
+            tile_frame[i].assign(tiles_x * tiles_y, 0);
+            buffer_frame[i] = 0;
+        }
+        depth_cleared.assign(tiles_x * tiles_y, 1);
+
+        frame_number = 0;
+        forget_shown();
+
+        hiz_blocks_x = (width + HIZ_BLOCK - 1) / HIZ_BLOCK;
+        hiz_blocks_y = (height + HIZ_BLOCK - 1) / HIZ_BLOCK;
+        reset_hiz();
 
-        drawing_state = 0;
+        tile_stats.resize(tiles_x * tiles_y);
+        reset_stats();
+        frame_stats = stats;
+
+        initialized = pixel_buffer && zbuffer;
     }
 
-    RenderDevice::~RenderDevice()
+    int RenderDevice::aligned_pitch(int width)
     {
-        delete framebuffer[0];
-        delete framebuffer[1];
+        /* rows are padded to a whole number of cache lines */
+        const int align = BUFFER_ALIGNMENT / sizeof(uint32_t);
+        return (width + align - 1) / align * align;
+    }
 
-        if (zbuffer) {
-            for (int i = 0; i < height; i++) {
-                if (zbuffer[i]) delete [] zbuffer[i];
-            }
+    void RenderDevice::allocate_zbuffer()
+    {
+        free(zbuffer);
+        zbuffer = nullptr;
+
+        void* depth = nullptr;
+        if (posix_memalign(&depth, BUFFER_ALIGNMENT, height * pitch * sizeof(Real)) == 0) {
+            zbuffer = (Real*)depth;
+        }
+    }
+
+    void RenderDevice::set_color_buffers(uint32_t* buffer0, uint32_t* buffer1, int buffer_pitch)
+    {
+        /* the presenter thread reads the buffers and the state reset below, and
+         * with external buffers would need a third of the device's */
+        flush();
+        set_swap_mode(SM_SYNC);
+
+        uint32_t* buffer2 = nullptr;
+        if (!buffer0 || !buffer1) {
+            buffer_pitch = aligned_pitch(width);
+            buffer0 = pixel_buffer;
+            buffer1 = pixel_buffer ? pixel_buffer + height * buffer_pitch : nullptr;
+            buffer2 = pixel_buffer ? pixel_buffer + 2 * height * buffer_pitch : nullptr;
         }
-        delete [] zbuffer;
 
-        clear_texbuffer();
+        framebuffer[0] = buffer0;
+        framebuffer[1] = buffer1;
+        framebuffer[2] = buffer2;
+        buffer_index = 0;
+        spare_buffer = 1;
 
-        if (pixel_buffer) munmap(pixel_buffer, framebuffer_size * 2);
+        /* the z-buffer shares the color buffers' pitch */
+        if (buffer_pitch != pitch) {
+            pitch = buffer_pitch;
+            allocate_zbuffer();
+        }
+
+        /* whatever the buffers hold, they start out cleared */
+        for (int i = 0; i < BUFFER_COUNT; i++) {
+            std::fill(color_cleared[i].begin(), color_cleared[i].end(), 1);
+            clear_value[i] = background;
+        }
+        std::fill(depth_cleared.begin(), depth_cleared.end(), 1);
+        reset_hiz();
+        forget_shown();
+    }
+
+    RenderDevice::~RenderDevice()
+    {
+        stop_presenter();
+        delete workers;
+
+        free(zbuffer);
+
+        for (Texture* tex : textures) {
+            if (tex) free_texture_image(tex);
+            delete tex;
+        }
+
+        if (pixel_buffer) munmap(pixel_buffer, framebuffer_size * BUFFER_COUNT);
     }
 
     void RenderDevice::clear()
     {
-        for (int i = 0; i < height; i++) {
-            for (int j = 0; j < width; j++) {
-                framebuffer[buffer_index][i][j] = background;
-                zbuffer[i][j] = 0.0;
+        /* pending triangles would be cleared away anyway */
+        discard_bins();
+
+        std::fill(color_cleared[buffer_index].begin(), color_cleared[buffer_index].end(), 1);
+        std::fill(depth_cleared.begin(), depth_cleared.end(), 1);
+        clear_value[buffer_index] = background;
+        reset_hiz();
+    }
+
+    RenderDevice::Rect RenderDevice::tile_rect(int tile) const
+    {
+        Rect r;
+        r.x0 = tile % tiles_x * TILE_SIZE;
+        r.y0 = tile / tiles_x * TILE_SIZE;
+        r.x1 = std::min(r.x0 + TILE_SIZE, width);
+        r.y1 = std::min(r.y0 + TILE_SIZE, height);
+        return r;
+    }
+
+    void RenderDevice::materialize_tile(int tile)
+    {
+        /* the tile is about to be drawn into, so plain stores that leave it cached */
+        Rect r = tile_rect(tile);
+        if (color_cleared[buffer_index][tile]) {
+            uint32_t* row = framebuffer[buffer_index] + r.y0 * pitch;
+            for (int y = r.y0; y < r.y1; y++, row += pitch) {
+                std::fill(row + r.x0, row + r.x1, clear_value[buffer_index]);
+            }
+            color_cleared[buffer_index][tile] = 0;
+        }
+        if (depth_cleared[tile]) {
+            Real* row = zbuffer + r.y0 * pitch;
+            for (int y = r.y0; y < r.y1; y++, row += pitch) {
+                std::fill(row + r.x0, row + r.x1, (Real)0);
+            }
+            depth_cleared[tile] = 0;
+        }
+    }
+
+    void RenderDevice::reset_hiz()
+    {
+        hiz_min.assign(hiz_blocks_x * hiz_blocks_y, 0);
+        hiz_max.assign(hiz_blocks_x * hiz_blocks_y, 0);
+        hiz_row_min.assign(hiz_blocks_x * hiz_blocks_y * HIZ_BLOCK, 0);
+
+        /* rows below the bottom of the screen never hold anything */
+        for (int y = height; y < hiz_blocks_y * HIZ_BLOCK; y++) {
+            for (int bx = 0; bx < hiz_blocks_x; bx++) {
+                int block = (y / HIZ_BLOCK) * hiz_blocks_x + bx;
+                hiz_row_min[block * HIZ_BLOCK + y % HIZ_BLOCK] = std::numeric_limits<Real>::max();
+            }
+        }
+    }
+
+    bool RenderDevice::hiz_occluded(int x0, int y0, int x1, int y1, Real max_invw)
+    {
+        for (int by = y0 / HIZ_BLOCK; by <= y1 / HIZ_BLOCK; by++) {
+            for (int bx = x0 / HIZ_BLOCK; bx <= x1 / HIZ_BLOCK; bx++) {
+                if (!(max_invw < hiz_min[by * hiz_blocks_x + bx])) return false;
             }
         }
+        return true;
+    }
+
+    int RenderDevice::hiz_test(int y, int x0, int x1, const Real* base, const Real* dadx)
+    {
+        Real z0 = base[ATTR_INVW] + dadx[ATTR_INVW] * x0;
+        Real z1 = base[ATTR_INVW] + dadx[ATTR_INVW] * x1;
+        Real slack = hiz_slack(fabs(base[ATTR_INVW]) + fabs(dadx[ATTR_INVW]) * (x1 + 1));
+
+        int block = (y / HIZ_BLOCK) * hiz_blocks_x + x0 / HIZ_BLOCK;
+        if (std::max(z0, z1) + slack < hiz_min[block]) return HIZ_OCCLUDED;
+        if (std::min(z0, z1) - slack >= hiz_max[block]) return HIZ_VISIBLE;
+        return HIZ_PARTIAL;
+    }
+
+    void RenderDevice::hiz_update(int y, int x)
+    {
+        int bx = x / HIZ_BLOCK;
+        int block = (y / HIZ_BLOCK) * hiz_blocks_x + bx;
+        int x0 = bx * HIZ_BLOCK;
+        int x1 = std::min(x0 + HIZ_BLOCK, width);
+
+        const Real* row = zbuffer + y * pitch;
+        Real lo = row[x0], hi = row[x0];
+        for (int i = x0 + 1; i < x1; i++) {
+            lo = std::min(lo, row[i]);
+            hi = std::max(hi, row[i]);
+        }
+
+        Real* rows = &hiz_row_min[block * HIZ_BLOCK];
+        rows[y % HIZ_BLOCK] = lo;
+        hiz_min[block] = *std::min_element(rows, rows + HIZ_BLOCK);
+        hiz_max[block] = std::max(hiz_max[block], hi);
     }
 
     void RenderDevice::clear_color(const Color& c)
@@ -90,28 +311,85 @@ namespace fbrender {
     void RenderDevice::set_camera(const Vector4& pos, const Vector4& at, const Vector4& up)
     {
         transform.set_view(Matrix4::lookat(pos, at, up));
-        camera_pos = pos;
-        camera_world_pos = camera_pos * transform.get_world();
+        transform.set_camera_pos(pos);
+    }
+
+    void RenderDevice::free_texture_image(Texture* tex)
+    {
+        delete [] tex->storage;
+        tex->storage = nullptr;
+        tex->width = tex->height = 0;
+        tex->level_count = 0;
+    }
+
+    int RenderDevice::create_texture()
+    {
+        for (size_t i = 1; i < textures.size(); i++) {
+            if (!textures[i]) {
+                textures[i] = new Texture();
+                return (int)i;
+            }
+        }
+
+        textures.push_back(new Texture());
+        return (int)textures.size() - 1;
+    }
+
+    void RenderDevice::bind_texture(int name)
+    {
+        if (name < 0 || name >= (int)textures.size() || !textures[name]) return;
+
+        bound_texture = name;
+        shading.texture = textures[name]->storage ? textures[name] : nullptr;
+        shading_dirty = true;
+    }
+
+    void RenderDevice::delete_texture(int name)
+    {
+        /* texture 0 can't be deleted, like in GL */
+        if (name <= 0 || name >= (int)textures.size() || !textures[name]) return;
+
+        /* binned triangles may still sample it */
+        flush();
+
+        free_texture_image(textures[name]);
+        delete textures[name];
+        textures[name] = nullptr;
+
+        if (bound_texture == name) bind_texture(0);
     }
 
-    void RenderDevice::clear_texbuffer()
+    /* box-filter a level down to the next one, a side of one texel stays one texel */
+    static void downsample_level(const uint32_t* src, int sw, int sh, uint32_t* dst, int dw, int dh)
     {
-        if (texbuffer) {
-            for (int i = 0; i < tex_height; i++) {
-                if (texbuffer[i]) delete [] texbuffer[i];
+        for (int y = 0; y < dh; y++) {
+            const uint32_t* r0 = src + std::min(2 * y, sh - 1) * sw;
+            const uint32_t* r1 = src + std::min(2 * y + 1, sh - 1) * sw;
+            for (int x = 0; x < dw; x++) {
+                int x0 = std::min(2 * x, sw - 1), x1 = std::min(2 * x + 1, sw - 1);
+                uint32_t texel = 0;
+                for (int shift = 0; shift < 32; shift += 8) {
+                    uint32_t sum = ((r0[x0] >> shift) & 0xff) + ((r0[x1] >> shift) & 0xff) +
+                                   ((r1[x0] >> shift) & 0xff) + ((r1[x1] >> shift) & 0xff);
+                    texel |= ((sum + 2) >> 2) << shift;
+                }
+                dst[y * dw + x] = texel;
             }
         }
-        delete [] texbuffer;
-        texbuffer = nullptr;
     }
 
     void RenderDevice::texture_image_2d(int width, int height, int format, const void* tex)
     {
-        if (texbuffer) clear_texbuffer();
+        /* binned triangles may still sample the old texture */
+        flush();
+
+        Texture* texture = textures[bound_texture];
+        free_texture_image(texture);
+        shading.texture = nullptr;
+        shading_dirty = true;
 
         char* tp = (char*)tex;
         if (width <= 0 || height <= 0) return;
-        texbuffer = new uint32_t*[height];
 
         size_t size;
         switch (format) {
@@ -123,47 +401,365 @@ namespace fbrender {
                 break;
         }
 
-        for (int i = 0; i < height; i++) {
-            uint32_t* line = new uint32_t[width];
-            for (int j = 0; j < width; j++) {
-                line[j] = *(uint32_t*)tp;
-                tp += size;
+        /* the whole mip chain down to 1x1 is built once here and lives in one block */
+        size_t offset[TEX_MAX_LEVELS];
+        size_t total = 0;
+        int levels = 0;
+        for (int w = width, h = height; levels < TEX_MAX_LEVELS; levels++) {
+            offset[levels] = total;
+            total += (size_t)w * h;
+            if (w == 1 && h == 1) {
+                levels++;
+                break;
             }
+            w = std::max(w / 2, 1);
+            h = std::max(h / 2, 1);
+        }
+
+        uint32_t* storage = new uint32_t[total];
+        for (int i = 0; i < width * height; i++) {
+            storage[i] = *(uint32_t*)tp;
+            tp += size;
+        }
 
-            texbuffer[i] = line;
+        for (int i = 0; i < levels; i++) {
+            texture->levels[i] = storage + offset[i];
+            if (i > 0) {
+                downsample_level(storage + offset[i - 1], std::max(width >> (i - 1), 1), std::max(height >> (i - 1), 1),
+                                 storage + offset[i], std::max(width >> i, 1), std::max(height >> i, 1));
+            }
         }
 
-        tex_height = height;
-        tex_width = width;
+        texture->storage = storage;
+        texture->level_count = levels;
+        texture->height = height;
+        texture->width = width;
+        shading.texture = texture;
+    }
+
+    void RenderDevice::set_subspan_length(int n)
+    {
+        int len = 1;
+        while (len * 2 <= n && len * 2 <= TILE_SIZE) len *= 2;
+        subspan_length = len;
+    }
+
+    void RenderDevice::set_worker_threads(int n)
+    {
+        flush();
+
+        delete workers;
+        workers = n > 0 ? new WorkerPool(n) : nullptr;
+    }
+
+    const ShadingState& RenderDevice::current_shading_state()
+    {
+        /* pick the pixel pipeline when the state changes rather than testing it per pixel */
+        if (shading_dirty) {
+            shading.light_world_pos = transform.get_light_world_pos();
+            derive_shading_state(shading, simd_level, color_path);
+            shading_dirty = false;
+            snapshot_stale = true;
+        }
+        return shading;
+    }
+
+    void RenderDevice::discard_bins()
+    {
+        binned_triangles.clear();
+        state_snapshots.clear();
+        for (size_t i = 0; i < tile_bins.size(); i++) {
+            tile_bins[i].clear();
+        }
+    }
+
+    void RenderDevice::bin_triangle(const Vertex& p1, const Vertex& p2, const Vertex& p3, const ShadingState& st)
+    {
+        if (snapshot_stale || state_snapshots.empty()) {
+            state_snapshots.push_back(st);
+            snapshot_stale = false;
+        }
+
+        uint32_t index = (uint32_t)binned_triangles.size();
+        binned_triangles.push_back(BinnedTriangle());
+        BinnedTriangle& tri = binned_triangles.back();
+        tri.v[0] = p1;
+        tri.v[1] = p2;
+        tri.v[2] = p3;
+        tri.state = (uint32_t)(state_snapshots.size() - 1);
+
+        const Vector4& a = p1.get_pos();
+        const Vector4& b = p2.get_pos();
+        const Vector4& c = p3.get_pos();
+
+        /* wireframe lines can reach a pixel past the filled area, so bin by the
+         * rounded-out bounding box */
+        int minx = (int)floor(std::min(a.x, std::min(b.x, c.x))) - 1;
+        int maxx = (int)ceil(std::max(a.x, std::max(b.x, c.x))) + 1;
+        int miny = (int)floor(std::min(a.y, std::min(b.y, c.y))) - 1;
+        int maxy = (int)ceil(std::max(a.y, std::max(b.y, c.y))) + 1;
+
+        int tx0 = std::max(minx, 0) / TILE_SIZE;
+        int ty0 = std::max(miny, 0) / TILE_SIZE;
+        int tx1 = std::min(maxx / TILE_SIZE, tiles_x - 1);
+        int ty1 = std::min(maxy / TILE_SIZE, tiles_y - 1);
+
+        for (int ty = ty0; ty <= ty1; ty++) {
+            for (int tx = tx0; tx <= tx1; tx++) {
+                tile_bins[ty * tiles_x + tx].push_back(index);
+            }
+        }
+    }
+
+    void RenderDevice::render_tile(int tile)
+    {
+        const std::vector<uint32_t>& bin = tile_bins[tile];
+        int tx = tile % tiles_x;
+        int ty = tile / tiles_x;
+
+        Rect clip;
+        clip.x0 = tx * TILE_SIZE;
+        clip.y0 = ty * TILE_SIZE;
+        clip.x1 = std::min(clip.x0 + TILE_SIZE, width);
+        clip.y1 = std::min(clip.y0 + TILE_SIZE, height);
+
+        for (size_t i = 0; i < bin.size(); i++) {
+            const BinnedTriangle& tri = binned_triangles[bin[i]];
+            draw_primitive(tri.v[0], tri.v[1], tri.v[2], state_snapshots[tri.state], clip);
+        }
+    }
+
+    void RenderDevice::flush()
+    {
+        if (binned_triangles.empty()) return;
+
+        /* every tile is owned by exactly one thread, so color and depth
+         * writes need no synchronization */
+        workers->run(tile_bins.size(), [this](size_t tile) { render_tile((int)tile); });
+
+        discard_bins();
+    }
+
+    void RenderDevice::forget_shown()
+    {
+        shown_cleared.assign(tiles_x * tiles_y, 0);
+        shown_value.assign(tiles_x * tiles_y, 0);
+        shown_frame.assign(tiles_x * tiles_y, std::numeric_limits<uint32_t>::max());
+    }
+
+    int RenderDevice::present_action(int buffer, int tile) const
+    {
+        if (color_cleared[buffer][tile]) {
+            bool shown = shown_cleared[tile] && shown_value[tile] == clear_value[buffer];
+            return shown ? PRESENT_SKIP : PRESENT_FILL;
+        }
+        bool shown = !shown_cleared[tile] && shown_frame[tile] == tile_frame[buffer][tile];
+        return shown ? PRESENT_SKIP : PRESENT_COPY;
+    }
+
+    void RenderDevice::mark_shown(int buffer, int tile)
+    {
+        shown_cleared[tile] = color_cleared[buffer][tile];
+        shown_value[tile] = clear_value[buffer];
+        shown_frame[tile] = tile_frame[buffer][tile];
+    }
+
+    /* calls emit(action, rect) for every run of tiles along a tile row that need
+     * the same present action */
+    template <class Emit>
+    void RenderDevice::for_each_present_run(int buffer, Emit emit)
+    {
+        for (int ty = 0; ty < tiles_y; ty++) {
+            int tx = 0;
+            while (tx < tiles_x) {
+                int action = present_action(buffer, ty * tiles_x + tx);
+                int end = tx + 1;
+                while (end < tiles_x && present_action(buffer, ty * tiles_x + end) == action) end++;
+
+                Rect r = tile_rect(ty * tiles_x + tx);
+                r.x1 = std::min(end * TILE_SIZE, width);
+                emit(action, r);
+                tx = end;
+            }
+        }
+    }
+
+    void RenderDevice::get_dirty_regions(std::vector<Rect>& regions)
+    {
+        flush();
+        /* the output side must settle before it can be compared against */
+        if (presenter) presenter->drain();
+
+        regions.clear();
+        for_each_present_run(buffer_index, [&regions](int action, const Rect& r) {
+            if (action == PRESENT_SKIP) return;
+            /* fills and copies are both changes, join them */
+            if (!regions.empty() && regions.back().y0 == r.y0 && regions.back().x1 == r.x0) {
+                regions.back().x1 = r.x1;
+            } else {
+                regions.push_back(r);
+            }
+        });
+    }
+
+    void RenderDevice::present_buffer(int buffer)
+    {
+        std::vector<unsigned char>& cleared = color_cleared[buffer];
+        uint32_t* pixels = framebuffer[buffer];
+        uint32_t value = clear_value[buffer];
+        size_t bytes = pitch * sizeof(uint32_t);
+
+        if (partial_present()) {
+            /* only tiles that differ from the output are sent, and tiles nothing
+             * was drawn into since clear() are filled there directly */
+            for_each_present_run(buffer, [&](int action, const Rect& r) {
+                if (action == PRESENT_FILL) {
+                    fill_rect(r.x0, r.y0, r.x1 - r.x0, r.y1 - r.y0, value);
+                } else if (action == PRESENT_COPY) {
+                    copy_rect(pixels, bytes, r.x0, r.y0, r.x1 - r.x0, r.y1 - r.y0);
+                }
+            });
+        } else {
+            for (size_t i = 0; i < cleared.size(); i++) {
+                if (!cleared[i]) continue;
+                Rect r = tile_rect((int)i);
+                fill_buffer(pixels + r.y0 * pitch + r.x0, pitch, r.x1 - r.x0, r.y1 - r.y0, value);
+                cleared[i] = 0;
+                tile_frame[buffer][i] = buffer_frame[buffer];
+            }
+            copy_buffer(pixels, bytes);
+        }
+
+        for (int i = 0; i < tiles_x * tiles_y; i++) {
+            mark_shown(buffer, i);
+        }
+    }
+
+    void RenderDevice::set_stats_enabled(bool enable)
+    {
+        flush();
+
+        stats_enabled = enable;
+        reset_stats();
+        frame_stats = stats;
+    }
+
+    void RenderDevice::reset_stats()
+    {
+        memset(&stats, 0, sizeof(stats));
+        std::fill(tile_stats.begin(), tile_stats.end(), stats);
     }
 
     void RenderDevice::swap_buffers()
     {
-        char* pfb = (char*)pixel_buffer;
-        pfb += buffer_index * framebuffer_size;
-        copy_buffer(pfb, framebuffer_size);
+        flush();
+
+        if (stats_enabled) {
+            for (size_t i = 0; i < tile_stats.size(); i++) {
+                stats.fragments += tile_stats[i].fragments;
+                stats.depth_rejected += tile_stats[i].depth_rejected;
+                stats.pixels_written += tile_stats[i].pixels_written;
+                stats.texture_samples += tile_stats[i].texture_samples;
+            }
+            stats.overdraw = (Real)stats.pixels_written / ((Real)width * height);
+            frame_stats = stats;
+            reset_stats();
+        }
+
+        buffer_frame[buffer_index] = frame_number++;
+
+        if (presenter) {
+            buffer_index = presenter->submit(buffer_index);
+        } else {
+            present_buffer(buffer_index);
+            present_totals.queued++;
+            present_totals.presented++;
+            std::swap(buffer_index, spare_buffer);
+        }
+
+        frame_swapped();
+    }
+
+    bool RenderDevice::set_swap_mode(int mode)
+    {
+        if (mode == swap_mode) return true;
+        if (mode != SM_SYNC && !framebuffer[2]) return false;
+
+        flush();
+        stop_presenter();
 
-        buffer_index = 1 - buffer_index;
+        if (mode != SM_SYNC) {
+            int policy = mode == SM_QUEUE ? FramePresenter::FP_QUEUE : FramePresenter::FP_MAILBOX;
+            presenter = new FramePresenter(BUFFER_COUNT, buffer_index, policy,
+                                           [this](int buffer) { present_buffer(buffer); });
+        }
+        swap_mode = mode;
+        return true;
+    }
+
+    void RenderDevice::stop_presenter()
+    {
+        if (!presenter) return;
+
+        /* the queued frame is still presented */
+        presenter->drain();
+        present_totals = get_present_stats();
+        delete presenter;
+        presenter = nullptr;
+        swap_mode = SM_SYNC;
+
+        /* any buffer but the one being drawn into will do for SM_SYNC */
+        spare_buffer = buffer_index == 0 ? 1 : 0;
+    }
+
+    RenderDevice::PresentStats RenderDevice::get_present_stats() const
+    {
+        PresentStats stats = present_totals;
+        if (presenter) {
+            stats.queued += presenter->frames_queued();
+            stats.presented += presenter->frames_presented();
+            stats.dropped += presenter->frames_dropped();
+        }
+        return stats;
     }
 
     void RenderDevice::draw_pixel(int x, int y, uint32_t color)
     {
-        if (x < width && y < height) {
-            framebuffer[buffer_index][y][x] = color;
+        flush();
+
+        if (x >= 0 && y >= 0 && x < width && y < height) {
+            count_plot(touch_tile(x, y));
+            framebuffer[buffer_index][y * pitch + x] = color;
         }
     }
 
     void RenderDevice::draw_line(int x1, int y1, int x2, int y2, uint32_t color)
     {
+        flush();
+
+        Rect screen = { 0, 0, width, height };
+        draw_line_clipped(x1, y1, x2, y2, color, screen);
+    }
+
+    void RenderDevice::draw_line_clipped(int x1, int y1, int x2, int y2, uint32_t color, const Rect& clip)
+    {
+#define PLOT(x, y, c) \
+        do { \
+            if ((x) >= clip.x0 && (y) >= clip.y0 && (x) < clip.x1 && (y) < clip.y1) { \
+                count_plot(touch_tile(x, y)); \
+                framebuffer[buffer_index][(y) * pitch + (x)] = (c); \
+            } \
+        } while (0)
+
         /* Bresenham algorithm */
         if (x1 == x2 && y1 == y2) {
-            draw_pixel(x1, y1, color);
+            PLOT(x1, y1, color);
         } else if (x1 == x2) {
             int step = y2 > y1 ? 1 : -1;
-            for (int i = y1; i != y2; i += step) draw_pixel(x1, i, color);
+            for (int i = y1; i != y2; i += step) PLOT(x1, i, color);
         } else if (y1 == y2) {
             int step = x2 > x1 ? 1 : -1;
-            for (int j = x1; j != x2; j += step) draw_pixel(j, y1, color);
+            for (int j = x1; j != x2; j += step) PLOT(j, y1, color);
         } else {
             int dx = x2 - x1;
             int dy = y2 - y1;
@@ -176,7 +772,7 @@ namespace fbrender {
             dy = (dy > 0) ? dy : -dy; 
             if (dx > dy) {
                 for (x = x1; x != x2; x += ux) {
-                    draw_pixel(x, y, color);
+                    PLOT(x, y, color);
                     eps += dy;
                     if ((eps << 1) >= dx) {
                         y += uy; 
@@ -185,7 +781,7 @@ namespace fbrender {
                 }
             } else {
                 for (y = y1; y != y2; y += uy) {
-                    draw_pixel(x, y, color);
+                    PLOT(x, y, color);
                     eps += dx;
                     if ((eps << 1) >= dy) {
                         x += ux; eps -= dy;
@@ -193,95 +789,463 @@ namespace fbrender {
                 }
             }    
         }
+#undef PLOT
+    }
+
+    void RenderDevice::transform_vertex(const Vertex& v, TransformedVertex& tv)
+    {
+        Vertex eye = transform.apply_mv_transform(v);
+        Vertex clip = transform.apply_projection(eye);
+
+        tv.eye_pos = eye.get_pos();
+        tv.outcode = transform.check_cvv(clip) ? clip_outcode(clip.get_pos()) : 0;
+        if (tv.outcode) {
+            tv.clip = Vertex(clip.get_pos(), eye.get_texcoord(), eye.get_color(), eye.get_world_pos(), Vector4());
+        }
+        if (!(tv.outcode & CLIP_GEOMETRY)) {
+            tv.screen = transform.homogenize(clip);
+        }
+        tv.valid = true;
+    }
+
+    int RenderDevice::clip_outcode(const Vector4& c)
+    {
+        const Real guard = (Real)GUARD_BAND * c.w;
+        int code = 0;
+
+        if (c.z < 0) code |= CLIP_NEAR;
+        if (c.z > c.w) code |= CLIP_FAR;
+        if (c.x < -c.w) code |= CLIP_LEFT;
+        if (c.x > c.w) code |= CLIP_RIGHT;
+        if (c.y < -c.w) code |= CLIP_BOTTOM;
+        if (c.y > c.w) code |= CLIP_TOP;
+        if (c.x < -guard) code |= GUARD_LEFT;
+        if (c.x > guard) code |= GUARD_RIGHT;
+        if (c.y < -guard) code |= GUARD_BOTTOM;
+        if (c.y > guard) code |= GUARD_TOP;
+
+        return code;
+    }
+
+    Vertex RenderDevice::project_clipped(const Vertex& clip)
+    {
+        /* the division Transform::apply_projection does, then the viewport mapping */
+        Real invw = 1.0 / clip.get_pos().w;
+        TexCoord tex = clip.get_texcoord();
+        Color color = clip.get_color();
+        Vector4 world_pos = clip.get_world_pos();
+        tex *= invw;
+        color *= invw;
+        world_pos *= invw;
+
+        return transform.homogenize(Vertex(clip.get_pos(), tex, color, world_pos, Vector4()));
     }
 
     void RenderDevice::draw_triangle(const Vertex& v1, const Vertex& v2, const Vertex& v3)
     {
-        Vertex p1 = v1;
-        Vertex p2 = v2;
-        Vertex p3 = v3;
+        TransformedVertex t1, t2, t3;
+
+        transform_vertex(v1, t1);
+        transform_vertex(v2, t2);
+        transform_vertex(v3, t3);
+
+        assemble_triangle(v1.get_pos(), v2.get_pos(), v3.get_pos(), t1, t2, t3);
+    }
+
+    void RenderDevice::draw_indexed(const Vertex* verts, size_t nverts, const uint32_t* indices, size_t nidx)
+    {
+        /* every vertex is transformed at most once per draw no matter how many triangles share it */
+        vertex_cache.resize(nverts);
+        for (size_t i = 0; i < nverts; i++) {
+            vertex_cache[i].valid = false;
+        }
+
+        for (size_t i = 0; i + 2 < nidx; i += 3) {
+            uint32_t i1 = indices[i];
+            uint32_t i2 = indices[i + 1];
+            uint32_t i3 = indices[i + 2];
+
+            if (i1 >= nverts || i2 >= nverts || i3 >= nverts) continue;
+
+            TransformedVertex& t1 = vertex_cache[i1];
+            TransformedVertex& t2 = vertex_cache[i2];
+            TransformedVertex& t3 = vertex_cache[i3];
+
+            if (!t1.valid) transform_vertex(verts[i1], t1);
+            if (!t2.valid) transform_vertex(verts[i2], t2);
+            if (!t3.valid) transform_vertex(verts[i3], t3);
+
+            assemble_triangle(verts[i1].get_pos(), verts[i2].get_pos(), verts[i3].get_pos(), t1, t2, t3);
+        }
+    }
+
+    void RenderDevice::execute(CommandBuffer& commands)
+    {
+        commands.sort(transform.get_view() * transform.get_projection());
+
+        auto apply = [this](const CommandBuffer::StateBlock& s) {
+            shading.drawing_state = s.drawing_state;
+            bind_texture(s.texture);
+            shading.tex_filter = s.tex_filter;
+            shading.material_ambient = s.material_ambient;
+            shading.material_diffuse = s.material_diffuse;
+            shading.material_specular = s.material_specular;
+            shading.material_emission = s.material_emission;
+            shading.material_shininess = s.material_shininess;
+            shading_dirty = true;
+        };
+
+        CommandBuffer::StateBlock saved = { shading.drawing_state, bound_texture, shading.tex_filter,
+                                            shading.material_ambient, shading.material_diffuse,
+                                            shading.material_specular, shading.material_emission,
+                                            shading.material_shininess };
+        Matrix4 saved_world = transform.get_world();
+
+        /* draws next to each other in the order often share their state or world */
+        const CommandBuffer::StateBlock* state = nullptr;
+        const Matrix4* world = nullptr;
+        for (size_t i = 0; i < commands.order.size(); i++) {
+            const CommandBuffer::Draw& d = commands.draws[commands.order[i]];
+            const CommandBuffer::StateBlock& s = commands.states[d.state];
+            const Matrix4& m = commands.worlds[d.world];
+
+            if (!state || !(*state == s)) {
+                apply(s);
+                state = &s;
+            }
+            if (world != &m) {
+                set_world(m);
+                world = &m;
+            }
+            draw_indexed(d.verts, d.nverts, d.indices, d.nidx);
+        }
 
-        Vector4 edge1 = p2.get_pos() - p1.get_pos();
-        Vector4 edge2 = p3.get_pos() - p2.get_pos();
+        apply(saved);
+        set_world(saved_world);
+    }
+
+    void RenderDevice::draw_indexed(const VertexStream& verts, const uint32_t* indices, size_t nidx)
+    {
+        const size_t n = verts.count;
+        const int nstreams = 15;
+
+        stream_buffer.resize(n * nstreams);
+        stream_clipped.resize(n);
+
+        Real* p = stream_buffer.data();
+        TransformedStream out;
+        Real** outs[nstreams] = {
+            &out.eye_x, &out.eye_y, &out.eye_z,
+            &out.screen_x, &out.screen_y, &out.screen_z, &out.invw,
+            &out.world_x, &out.world_y, &out.world_z,
+            &out.u, &out.v, &out.r, &out.g, &out.b,
+        };
+        for (int i = 0; i < nstreams; i++) {
+            *outs[i] = p + i * n;
+        }
+        /* triangles are lit with their face normal, the vertex normals aren't needed */
+        out.nx = out.ny = out.nz = nullptr;
+        out.clipped = stream_clipped.data();
+
+        transform.transform_stream(verts, out);
+
+        vertex_cache.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            TransformedVertex& tv = vertex_cache[i];
+
+            if (out.clipped[i]) {
+                /* rare enough to take the per-vertex path, which keeps the clip-space
+                 * vertex; normals are replaced by the face normal anyway */
+                transform_vertex(Vertex(verts.x[i], verts.y[i], verts.z[i], 1.0,
+                                        verts.u ? verts.u[i] : 0, verts.v ? verts.v[i] : 0,
+                                        verts.r ? verts.r[i] : 0, verts.g ? verts.g[i] : 0,
+                                        verts.b ? verts.b[i] : 0), tv);
+                continue;
+            }
+
+            tv.eye_pos = Vector4(out.eye_x[i], out.eye_y[i], out.eye_z[i], 1.0);
+            tv.outcode = 0;
+            tv.screen = Vertex(Vector4(out.screen_x[i], out.screen_y[i], out.screen_z[i], 1.0),
+                               TexCoord(out.u[i], out.v[i]),
+                               Color(out.r[i], out.g[i], out.b[i]),
+                               Vector4(out.world_x[i], out.world_y[i], out.world_z[i]),
+                               Vector4());
+            tv.screen.set_one_per_w(out.invw[i]);
+            tv.valid = true;
+        }
+
+        for (size_t i = 0; i + 2 < nidx; i += 3) {
+            uint32_t i1 = indices[i];
+            uint32_t i2 = indices[i + 1];
+            uint32_t i3 = indices[i + 2];
+
+            if (i1 >= n || i2 >= n || i3 >= n) continue;
+
+            assemble_triangle(Vector4(verts.x[i1], verts.y[i1], verts.z[i1], 1.0),
+                              Vector4(verts.x[i2], verts.y[i2], verts.z[i2], 1.0),
+                              Vector4(verts.x[i3], verts.y[i3], verts.z[i3], 1.0),
+                              vertex_cache[i1], vertex_cache[i2], vertex_cache[i3]);
+        }
+    }
+
+    void RenderDevice::assemble_triangle(const Vector4& o1, const Vector4& o2, const Vector4& o3,
+                                         const TransformedVertex& t1, const TransformedVertex& t2, const TransformedVertex& t3)
+    {
+        if (stats_enabled) stats.triangles_submitted++;
+
+        if (!back_face_test(t1.eye_pos, t2.eye_pos, t3.eye_pos)) {
+            if (stats_enabled) stats.triangles_culled++;
+            return;
+        }
+
+        /* entirely outside one plane of the view volume */
+        if (t1.outcode & t2.outcode & t3.outcode) {
+            if (stats_enabled) stats.triangles_cvv_rejected++;
+            return;
+        }
+
+        /* the face normal depends on the whole triangle so it can't live in the vertex cache */
+        Vector4 edge1 = o2 - o1;
+        Vector4 edge2 = o3 - o2;
 
         Vector4 _normal = edge1.cross_product(edge2);
-        const Matrix4& mw = transform.get_world();
-        Vector4 normal = _normal * mw.inverse().transpose();
-        p1.set_normal(normal);
-        p2.set_normal(normal);
-        p3.set_normal(normal);
+        Vector4 normal = _normal * transform.get_normal_matrix();
+
+        int planes = (t1.outcode | t2.outcode | t3.outcode) & CLIP_GEOMETRY;
+        if (planes) {
+            clip_triangle(t1, t2, t3, planes, normal);
+        } else {
+            submit_triangle(t1.screen, t2.screen, t3.screen, normal);
+        }
+    }
+
+    void RenderDevice::submit_triangle(Vertex p1, Vertex p2, Vertex p3, const Vector4& normal)
+    {
+        if (stats_enabled) stats.triangles_rasterized++;
+
+        const ShadingState& st = current_shading_state();
+
+        p1.set_normal(normal * p1.get_one_per_w());
+        p2.set_normal(normal * p2.get_one_per_w());
+        p3.set_normal(normal * p3.get_one_per_w());
+
+        if (st.drawing_state & DS_LIGHTING_GOURAUD) {
+            lighting(p1, normal, st);
+            lighting(p2, normal, st);
+            lighting(p3, normal, st);
+        }
+
+        if (workers) {
+            bin_triangle(p1, p2, p3, st);
+        } else {
+            Rect screen = { 0, 0, width, height };
+            draw_primitive(p1, p2, p3, st, screen);
+        }
+    }
 
-        p1 = transform.apply_mv_transform(p1); 
-        p2 = transform.apply_mv_transform(p2); 
-        p3 = transform.apply_mv_transform(p3);
+    Real RenderDevice::clip_distance(const Vector4& c, int plane)
+    {
+        const Real guard = (Real)GUARD_BAND * c.w;
+        switch (plane) {
+            case CLIP_NEAR: return c.z;
+            case CLIP_FAR: return c.w - c.z;
+            case GUARD_LEFT: return c.x + guard;
+            case GUARD_RIGHT: return guard - c.x;
+            case GUARD_BOTTOM: return c.y + guard;
+            default: return guard - c.y;
+        }
+    }
+
+    Vertex RenderDevice::unproject(const Vertex& screen)
+    {
+        /* undoes homogenize and the division by w for a vertex that went through them */
+        const Vector4& p = screen.get_pos();
+        Real w = 1 / screen.get_one_per_w();
+        TexCoord tex = screen.get_texcoord();
+        Color color = screen.get_color();
+        Vector4 world_pos = screen.get_world_pos();
+        tex *= w;
+        color *= w;
+        world_pos *= w;
+
+        Vector4 clip((p.x * 2 / width - 1) * w, (1 - p.y * 2 / height) * w, p.z * w, w);
+        return Vertex(clip, tex, color, world_pos, Vector4());
+    }
 
-        if (!back_face_test(p1, p2, p3)) return;
+    /* attributes are linear in clip space as long as they are not divided by w */
+    static Vertex lerp_clipped(const Vertex& a, const Vertex& b, Real t)
+    {
+#define LERP(x, y) ((x) + ((y) - (x)) * t)
+        const Vector4& pa = a.get_pos();
+        const Vector4& pb = b.get_pos();
+        const TexCoord& ta = a.get_texcoord();
+        const TexCoord& tb = b.get_texcoord();
+        const Color& ca = a.get_color();
+        const Color& cb = b.get_color();
+        const Vector4& wa = a.get_world_pos();
+        const Vector4& wb = b.get_world_pos();
+
+        return Vertex(Vector4(LERP(pa.x, pb.x), LERP(pa.y, pb.y), LERP(pa.z, pb.z), LERP(pa.w, pb.w)),
+                      TexCoord(LERP(ta.u, tb.u), LERP(ta.v, tb.v)),
+                      Color(LERP(ca.r, cb.r), LERP(ca.g, cb.g), LERP(ca.b, cb.b)),
+                      Vector4(LERP(wa.x, wb.x), LERP(wa.y, wb.y), LERP(wa.z, wb.z)),
+                      Vector4());
+#undef LERP
+    }
 
-        Vertex c1 = transform.apply_projection(p1);
-        Vertex c2 = transform.apply_projection(p2); 
-        Vertex c3 = transform.apply_projection(p3); 
+    void RenderDevice::clip_triangle(const TransformedVertex& t1, const TransformedVertex& t2,
+                                     const TransformedVertex& t3, int planes, const Vector4& normal)
+    {
+        /* Sutherland-Hodgman: each plane crossed adds at most one vertex */
+        Vertex buffers[2][3 + 6];
+        Vertex* poly = buffers[0];
+        Vertex* next = buffers[1];
+        int count = 3;
+
+        const TransformedVertex* ts[3] = { &t1, &t2, &t3 };
+        for (int i = 0; i < 3; i++) {
+            poly[i] = ts[i]->outcode ? ts[i]->clip : unproject(ts[i]->screen);
+        }
 
-        if (transform.check_cvv(c1)) return;
-        if (transform.check_cvv(c2)) return;
-        if (transform.check_cvv(c3)) return;
+        for (int plane = CLIP_NEAR; plane <= GUARD_TOP; plane <<= 1) {
+            if (!(planes & plane)) continue;
 
-        p1 = transform.homogenize(c1);
-        p2 = transform.homogenize(c2);
-        p3 = transform.homogenize(c3);
+            int n = 0;
+            for (int i = 0; i < count; i++) {
+                const Vertex& a = poly[i];
+                const Vertex& b = poly[(i + 1) % count];
+                Real da = clip_distance(a.get_pos(), plane);
+                Real db = clip_distance(b.get_pos(), plane);
+
+                if (da >= 0) next[n++] = a;
+                if ((da >= 0) != (db >= 0)) next[n++] = lerp_clipped(a, b, da / (da - db));
+            }
+
+            std::swap(poly, next);
+            count = n;
+            if (count < 3) return;
+        }
+
+        /* the polygon is convex, draw it as a fan */
+        Vertex first = project_clipped(poly[0]);
+        Vertex prev = project_clipped(poly[1]);
+        for (int i = 2; i < count; i++) {
+            Vertex cur = project_clipped(poly[i]);
+            submit_triangle(first, prev, cur, normal);
+            prev = cur;
+        }
+    }
+
+    void RenderDevice::lighting(Vertex& v, const Vector4& normal, const ShadingState& st)
+    {
+        /* the same diffuse model as the pixel stage, on attributes that are
+         * already divided by w */
+        Real w = 1 / v.get_one_per_w();
+        const Vector4& wp = v.get_world_pos();
+        Vector4 world_pos = Vector4(wp.x * w, wp.y * w, wp.z * w);
+        Vector4 n = normal;
+        n.normalize();
+
+        Vector4 light_dir = world_pos - st.light_world_pos;
+        light_dir.normalize();
+
+        Real kdiffuse = light_dir.dot_product(n);
+        if (kdiffuse < 0) kdiffuse = 0;
+
+        Color diffuse = st.material_diffuse * kdiffuse + st.diffuse_color * kdiffuse;
+        Color lcolor = diffuse + st.ambient_color;
+
+        /* without vertex colors the light itself is interpolated to modulate the texture */
+        Color color = (st.drawing_state & DS_COLOR) ? (v.get_color() * w) * lcolor : lcolor;
+        v.set_color(color * v.get_one_per_w());
+    }
 
-        if (drawing_state & (DS_COLOR | DS_TEXTURE_2D)) {
-            rasterize_triangle(p1, p2, p3);  
+    void RenderDevice::draw_primitive(const Vertex& p1, const Vertex& p2, const Vertex& p3,
+                                      const ShadingState& st, const Rect& clip)
+    {
+        if (st.drawing_state & (DS_COLOR | DS_TEXTURE_2D)) {
+            /* only the half-space rasterizer can be confined to a tile */
+            if (raster_mode == RM_HALF_SPACE || workers) {
+                rasterize_triangle_half_space(p1, p2, p3, st, clip);
+            } else {
+                rasterize_triangle(p1, p2, p3, st);  
+            }
         } 
-        if (drawing_state & DS_WIREFRAME) {
+        if (st.drawing_state & DS_WIREFRAME) {
             const Vector4& pos1 = p1.get_pos();
             const Vector4& pos2 = p2.get_pos();
             const Vector4& pos3 = p3.get_pos();
 
-            draw_line(pos1.x, pos1.y, pos2.x, pos2.y, foreground);
-            draw_line(pos1.x, pos1.y, pos3.x, pos3.y, foreground);
-            draw_line(pos2.x, pos2.y, pos3.x, pos3.y, foreground);
+            draw_line_clipped(pos1.x, pos1.y, pos2.x, pos2.y, st.foreground, clip);
+            draw_line_clipped(pos1.x, pos1.y, pos3.x, pos3.y, st.foreground, clip);
+            draw_line_clipped(pos2.x, pos2.y, pos3.x, pos3.y, st.foreground, clip);
         }
     }
 
-    bool RenderDevice::back_face_test(const Vertex& v1, const Vertex& v2, const Vertex& v3)
+    bool RenderDevice::back_face_test(const Vector4& p1, const Vector4& p2, const Vector4& p3)
     {
-        if (drawing_state & DS_WIREFRAME) {
+        if (shading.drawing_state & DS_WIREFRAME) {
             return true;
         }
 
-        Vector4 vec1 = v2.get_pos() - v1.get_pos();
-        Vector4 vec2 = v3.get_pos() - v2.get_pos();
+        return front_facing(p1, p2, p3);
+    }
+
+    bool RenderDevice::front_facing(const Vector4& p1, const Vector4& p2, const Vector4& p3)
+    {
+        Vector4 vec1 = p2 - p1;
+        Vector4 vec2 = p3 - p2;
 
         Vector4 normal = vec1.cross_product(vec2);
-        Vector4 dir = v1.get_pos();
-        Real dot = normal.dot_product(dir);
+        Real dot = normal.dot_product(p1);
 
         return dot > 0;
     }
 
-    void RenderDevice::rasterize_triangle(const Vertex& v1, const Vertex& v2, const Vertex& v3)
+    void RenderDevice::rasterize_triangle(const Vertex& v1, const Vertex& v2, const Vertex& v3, const ShadingState& st)
     {
         const Vector4& p1 = v1.get_pos();
         const Vector4& p2 = v2.get_pos();
         const Vector4& p3 = v3.get_pos();
 
+        /* spans only know the x gradients, mip level selection needs the y ones too */
+        Real dady_plane[ATTR_COUNT];
+        const Real* dady = nullptr;
+        if (mipmapped(st)) {
+            Real a1[ATTR_COUNT], a2[ATTR_COUNT], a3[ATTR_COUNT];
+            load_attributes(v1, a1);
+            load_attributes(v2, a2);
+            load_attributes(v3, a3);
+
+            Real dx2 = p2.x - p1.x, dy2 = p2.y - p1.y;
+            Real dx3 = p3.x - p1.x, dy3 = p3.y - p1.y;
+            Real area = dx2 * dy3 - dy2 * dx3;
+            if (area != 0) {
+                for (int k = 0; k < st.attr_count; k++) {
+                    int i = st.attrs[k];
+                    dady_plane[i] = (dx2 * (a3[i] - a1[i]) - (a2[i] - a1[i]) * dx3) / area;
+                }
+                dady = dady_plane;
+            }
+        }
+
         if (p1.y == p2.y) {
             if (p1.y < p3.y) {
-                draw_triangle_top(v1, v2, v3);
+                draw_triangle_top(v1, v2, v3, dady, st);
             } else {
-                draw_triangle_bottom(v3, v1, v2);
+                draw_triangle_bottom(v3, v1, v2, dady, st);
             }
         } else if (p1.y == p3.y) {
             if (p1.y < p2.y) {
-                draw_triangle_top(v1, v3, v2);
+                draw_triangle_top(v1, v3, v2, dady, st);
             } else {
-                draw_triangle_bottom(v2, v1, v3);
+                draw_triangle_bottom(v2, v1, v3, dady, st);
             }
         } else if (p2.y == p3.y) {
             if (p2.y < p1.y) {
-                draw_triangle_top(v2, v3, v1);
+                draw_triangle_top(v2, v3, v1, dady, st);
             } else {
-                draw_triangle_bottom(v1, v2, v3);
+                draw_triangle_bottom(v1, v2, v3, dady, st);
             }
         } else {
             /* sort vertexes by y */
@@ -302,19 +1266,29 @@ namespace fbrender {
             Vertex new_middle(middle_x, mp.y, 0, 0, 0, 0, 0, 0, 0); 
             new_middle.lerp(top, bottom, ratio);
 
-            draw_triangle_bottom(top, new_middle, middle);
-            draw_triangle_top(new_middle, middle, bottom);
+            draw_triangle_bottom(top, new_middle, middle, dady, st);
+            draw_triangle_top(new_middle, middle, bottom, dady, st);
         }
     }
 
 #define ROUND_AWAY_FROM_ZERO(x) (int)(((x) < 0) ? floor(x) : ceil(x))
-    void RenderDevice::draw_triangle_top(const Vertex& v1, const Vertex& v2, const Vertex& v3)
+
+    /* triangles may start far above the screen inside the guard band, skip the
+     * rows there without moving the half-pixel steps off the vertex */
+    static inline Real first_scan_y(Real y)
+    {
+        if (y < -1) y += std::floor((-1 - y) * 2) * (Real)0.5;
+        return y;
+    }
+
+    void RenderDevice::draw_triangle_top(const Vertex& v1, const Vertex& v2, const Vertex& v3,
+                                         const Real* dady, const ShadingState& st)
     {
         const Vector4& p1 = v1.get_pos();
         const Vector4& p2 = v2.get_pos();
         const Vector4& p3 = v3.get_pos();
 
-        for (Real y = p1.y; y <= p3.y; y += (Real)0.5) {
+        for (Real y = first_scan_y(p1.y), y_end = std::min(p3.y, (Real)height); y <= y_end; y += (Real)0.5) {
             int yi = ROUND_AWAY_FROM_ZERO(y);
 
             if (yi >= 0 && yi < height) {
@@ -331,20 +1305,21 @@ namespace fbrender {
                 const Vector4& np1 = n1.get_pos();
                 const Vector4& np2 = n2.get_pos();
                 if (np1.x < np2.x) {
-                    draw_scan_line(n1, n2, yi);
+                    draw_scan_line(n1, n2, yi, dady, st);
                 } else {
-                    draw_scan_line(n2, n1, yi);
+                    draw_scan_line(n2, n1, yi, dady, st);
                 }
             }
         }
 }
-    void RenderDevice::draw_triangle_bottom(const Vertex& v1, const Vertex& v2, const Vertex& v3)
+    void RenderDevice::draw_triangle_bottom(const Vertex& v1, const Vertex& v2, const Vertex& v3,
+                                            const Real* dady, const ShadingState& st)
     {
         const Vector4& p1 = v1.get_pos();
         const Vector4& p2 = v2.get_pos();
         const Vector4& p3 = v3.get_pos();
 
-        for (Real y = p1.y; y <= p3.y; y += (Real)0.5) {
+        for (Real y = first_scan_y(p1.y), y_end = std::min(p3.y, (Real)height); y <= y_end; y += (Real)0.5) {
             int yi = ROUND_AWAY_FROM_ZERO(y);
 
             if (yi >= 0 && yi < height) {
@@ -361,91 +1336,105 @@ namespace fbrender {
                 const Vector4& np1 = n1.get_pos();
                 const Vector4& np2 = n2.get_pos();
                 if (np1.x < np2.x) {
-                    draw_scan_line(n1, n2, yi);
+                    draw_scan_line(n1, n2, yi, dady, st);
                 } else {
-                    draw_scan_line(n2, n1, yi);
+                    draw_scan_line(n2, n1, yi, dady, st);
                 }
             }
         }
     }
 
-    void RenderDevice::draw_scan_line(const Vertex& left, const Vertex& right, int y_index)
+    void RenderDevice::load_attributes(const Vertex& v, Real* attr)
+    {
+        const TexCoord& tex = v.get_texcoord();
+        const Color& color = v.get_color();
+        const Vector4& world_pos = v.get_world_pos();
+        const Vector4& normal = v.get_normal();
+
+        attr[ATTR_INVW] = v.get_one_per_w();
+        attr[ATTR_U] = tex.u;
+        attr[ATTR_V] = tex.v;
+        attr[ATTR_R] = color.r;
+        attr[ATTR_G] = color.g;
+        attr[ATTR_B] = color.b;
+        attr[ATTR_WX] = world_pos.x;
+        attr[ATTR_WY] = world_pos.y;
+        attr[ATTR_WZ] = world_pos.z;
+        attr[ATTR_NX] = normal.x;
+        attr[ATTR_NY] = normal.y;
+        attr[ATTR_NZ] = normal.z;
+    }
+
+    void RenderDevice::draw_scan_line(const Vertex& left, const Vertex& right, int y_index,
+                                      const Real* dady, const ShadingState& st)
     {
         const Vector4& lp = left.get_pos();
         const Vector4& rp = right.get_pos();
-        const TexCoord& lvt = left.get_texcoord();
-        const TexCoord& rvt = right.get_texcoord();
-        const Color& lvc = left.get_color();
-        const Color& rvc = right.get_color();
-        const Vector4& lwp = left.get_world_pos();
-        const Vector4& rwp = right.get_world_pos();
-        const Vector4& lnm = left.get_normal();
-        const Vector4& rnm = right.get_normal();
-        
-        Real dx = rp.x - lp.x;
-        for (Real x = lp.x; x <= rp.x; x += (Real)0.5) {
-            int x_index = (int)(x + 0.5);
-        
-            if (x_index >= 0 && x_index < width) {
-                Real t = 0;
-                if (dx != 0) {
-                    t = (x - lp.x) / dx;
-                }
-
-#define LERP(a, b, t) ((b) * (t) + (1 - (t)) * (a))
-                Real invw = LERP(left.get_one_per_w(), right.get_one_per_w(), t);
-                if (invw >= zbuffer[y_index][x_index]) {
-                    Real w = 1 / invw;
-                    zbuffer[y_index][x_index] = invw;
-
-                    Real u = LERP(lvt.u, rvt.u, t) * w * (tex_width - 1);
-                    Real v = LERP(lvt.v, rvt.v, t) * w * (tex_height - 1);
-
-                    Color tex_color;
-                    if (drawing_state & DS_TEXTURE_2D) {
-                        if (tex_filter == TF_NEAREST) {
-                            int ui = ROUND_AWAY_FROM_ZERO(u);
-                            int vi = ROUND_AWAY_FROM_ZERO(v);
-                            
-                            ui = ui <= 0 ? 0 : ui >= tex_width ? (tex_width - 1) : ui;
-                            vi = vi <= 0 ? 0 : vi >= tex_height ? (tex_height - 1) : vi;
-                            tex_color = Color(texbuffer[vi][ui]);
-                        }
-                    }
-
-                    Color vcolor = Color(LERP(lvc.r, rvc.r, t) * w,
-                            LERP(lvc.g, rvc.g, t) * w,
-                            LERP(lvc.b, rvc.b, t) * w);
-
-                    Vector4 world_pos = Vector4::lerp(lwp, rwp, t) * w;
-                    Vector4 normal = Vector4::lerp(lnm, rnm, t) * w;
+        Real la[ATTR_COUNT], ra[ATTR_COUNT], base[ATTR_COUNT], dadx[ATTR_COUNT];
 
-                    normal.normalize(); 
+        int x0 = std::max((int)(lp.x + 0.5), 0);
+        int x1 = std::min((int)(rp.x + 0.5), width - 1);
+        if (x0 > x1) return;
 
-                    Vector4 light_dir = world_pos - light_world_pos;
-                    light_dir.normalize();
+        load_attributes(left, la);
+        load_attributes(right, ra);
 
-                    Real kdiffuse = light_dir.dot_product(normal);
-                    if (kdiffuse < 0) kdiffuse = 0;
+        /* span setup: per-pixel gradients and the values extrapolated to x = 0 */
+        Real dx = rp.x - lp.x;
+        Real inv_dx = dx != 0 ? 1 / dx : 0;
+        for (int k = 0; k < st.attr_count; k++) {
+            int i = st.attrs[k];
+            dadx[i] = (ra[i] - la[i]) * inv_dx;
+            base[i] = la[i] - dadx[i] * lp.x;
+        }
 
-                    Color diffuse = material_diffuse * kdiffuse + diffuse_color * kdiffuse;
+        draw_span(y_index, x0, x1, base, dadx, dady, st);
+    }
 
-                    Color lcolor = diffuse + ambient_color;
+    void RenderDevice::draw_span(int y, int x0, int x1, const Real* base, const Real* dadx, const Real* dady,
+                                 const ShadingState& st)
+    {
+        const bool mip = mipmapped(st);
+        shade_span(y, x0, x1, base, dadx, st.attrs, st.attr_count, (st.features & SF_TEXTURE) != 0,
+                   [&](SpanSegment& seg) { if (mip) select_texture_lod(seg, st, seg.start, dadx, dady); },
+                   [&](SpanSegment& seg) { return st.kernel(seg, st); });
+    }
 
-                    if (drawing_state & DS_LIGHTING) {
-                        vcolor = vcolor * lcolor;
-                        tex_color = tex_color * lcolor;
-                    }
+    void RenderDevice::rasterize_triangle_half_space(const Vertex& v1, const Vertex& v2, const Vertex& v3,
+                                                     const ShadingState& st, const Rect& clip)
+    {
+        Real x[3] = { v1.get_pos().x, v2.get_pos().x, v3.get_pos().x };
+        Real y[3] = { v1.get_pos().y, v2.get_pos().y, v3.get_pos().y };
+        Real a1[ATTR_COUNT], a2[ATTR_COUNT], a3[ATTR_COUNT];
+        const Real* a[3] = { a1, a2, a3 };
+
+        load_attributes(v1, a1);
+        load_attributes(v2, a2);
+        load_attributes(v3, a3);
+
+        rasterize_half_space<ATTR_COUNT>(x, y, a, st.attrs, st.attr_count, clip,
+            [&](int y, int x0, int x1, const Real* base, const Real* dadx, const Real* dady) {
+                draw_span(y, x0, x1, base, dadx, dady, st);
+            });
+    }
 
-                    if (drawing_state & DS_COLOR) {
-                        draw_pixel(x_index, y_index, vcolor.color_value());
-                    } else if (drawing_state & DS_TEXTURE_2D) {
-                        draw_pixel(x_index, y_index, tex_color.color_value());
-                    }
-                }
-            }
-        }
+    ShaderUniforms RenderDevice::shader_uniforms()
+    {
+        ShaderUniforms u;
+        u.world = transform.get_world();
+        u.world_view = transform.get_world_view();
+        u.projection = transform.get_projection();
+        u.world_view_projection = transform.get_world_view_projection();
+        u.normal_matrix = transform.get_normal_matrix();
+        u.light_world_pos = transform.get_light_world_pos();
+        u.ambient_color = shading.ambient_color;
+        u.diffuse_color = shading.diffuse_color;
+        u.material_diffuse = shading.material_diffuse;
+        u.texture = shading.texture;
+        u.tex_filter = shading.tex_filter;
+        u.simd_level = simd_level;
+        u.color_path = color_path;
+        return u;
     }
 
 }
-
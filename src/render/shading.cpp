@@ -0,0 +1,846 @@
+#include "render/shading.h"
+#include "render/render_device.h"
+
+#include <algorithm>
+#include <cmath>
+
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace fbrender {
+
+    static inline int level_size(int size, int lod)
+    {
+        return std::max(size >> lod, 1);
+    }
+
+    static inline uint32_t sample_nearest(const ShadingState& st, int lod, Real s, Real t)
+    {
+        return texel_nearest(*st.texture, lod, s, t);
+    }
+
+    /* the four texels around (s, t) weighted by distance, clamped to the edges */
+    static inline Color sample_bilinear(const ShadingState& st, int lod, Real s, Real t)
+    {
+        int w = level_size(st.texture->width, lod);
+        int h = level_size(st.texture->height, lod);
+        Real u = CLAMP(s * (w - 1), 0, w - 1);
+        Real v = CLAMP(t * (h - 1), 0, h - 1);
+
+        int u0 = (int)u, v0 = (int)v;
+        int u1 = std::min(u0 + 1, w - 1), v1 = std::min(v0 + 1, h - 1);
+        Real fu = u - u0, fv = v - v0;
+
+        const uint32_t* row0 = st.texture->levels[lod] + v0 * w;
+        const uint32_t* row1 = st.texture->levels[lod] + v1 * w;
+        uint32_t t00 = row0[u0], t10 = row0[u1], t01 = row1[u0], t11 = row1[u1];
+
+        Real w00 = (1 - fu) * (1 - fv), w10 = fu * (1 - fv);
+        Real w01 = (1 - fu) * fv, w11 = fu * fv;
+#define CHANNEL(shift) (((t00 >> shift) & 0xff) * w00 + ((t10 >> shift) & 0xff) * w10 + \
+                        ((t01 >> shift) & 0xff) * w01 + ((t11 >> shift) & 0xff) * w11) * (Real)(1.0 / 255)
+        return Color(CHANNEL(16), CHANNEL(8), CHANNEL(0));
+#undef CHANNEL
+    }
+
+    /* seg.lod is 0 unless the filter is mipmapping */
+    template <int F>
+    static inline Color sample_texture(const SpanSegment& seg, const ShadingState& st, Real s, Real t)
+    {
+        if (!(F & SF_LINEAR)) return Color(sample_nearest(st, seg.lod, s, t));
+
+        Color c = sample_bilinear(st, seg.lod, s, t);
+        if ((F & SF_LOD_BLEND) && seg.lod_blend > 0) {
+            c = c * (1 - seg.lod_blend) + sample_bilinear(st, seg.lod + 1, s, t) * seg.lod_blend;
+        }
+        return c;
+    }
+
+    void select_texture_lod(SpanSegment& seg, const ShadingState& st, const Real* attr,
+                            const Real* dadx, const Real* dady)
+    {
+        /* the planes interpolate u / w and v / w, so du/dx = (d(u/w)/dx - u d(1/w)/dx) * w */
+        Real w = 1 / attr[ATTR_INVW];
+        Real su = st.texture->width * w, sv = st.texture->height * w;
+        Real dudx = (dadx[ATTR_U] - attr[ATTR_U] * dadx[ATTR_INVW]) * su;
+        Real dvdx = (dadx[ATTR_V] - attr[ATTR_V] * dadx[ATTR_INVW]) * sv;
+        Real rho2 = dudx * dudx + dvdx * dvdx;
+        if (dady) {
+            Real dudy = (dady[ATTR_U] - attr[ATTR_U] * dady[ATTR_INVW]) * su;
+            Real dvdy = (dady[ATTR_V] - attr[ATTR_V] * dady[ATTR_INVW]) * sv;
+            rho2 = std::max(rho2, dudy * dudy + dvdy * dvdy);
+        }
+
+        /* lambda = log2(rho), clamped to the chain */
+        int top = st.texture->level_count - 1;
+        Real lambda = rho2 > 1 ? (Real)0.5 * std::log2(rho2) : 0;
+        if (!(lambda < top)) lambda = top;
+
+        if (st.tex_filter == RenderDevice::TF_LINEAR_MIPMAP_LINEAR) {
+            seg.lod = (int)lambda;
+            seg.lod_blend = lambda - seg.lod;
+        } else {
+            seg.lod = (int)(lambda + (Real)0.5);
+            seg.lod_blend = 0;
+        }
+    }
+
+    int shade_features(const ShadingState& st)
+    {
+        const int ds = st.drawing_state;
+        int features = 0;
+
+        if (ds & RenderDevice::DS_COLOR) {
+            features = SF_COLOR;
+        } else if ((ds & RenderDevice::DS_TEXTURE_2D) && st.texture) {
+            features = SF_TEXTURE;
+            if (ds & RenderDevice::DS_LIGHTING_GOURAUD) features |= SF_MODULATE;
+            if (st.tex_filter & (RenderDevice::TF_LINEAR | RenderDevice::TF_LINEAR_MIPMAP_LINEAR)) features |= SF_LINEAR;
+            if (st.tex_filter == RenderDevice::TF_LINEAR_MIPMAP_LINEAR) features |= SF_LOD_BLEND;
+        }
+
+        /* under DS_LIGHTING_GOURAUD the vertexes are lit instead */
+        if (features && (ds & RenderDevice::DS_LIGHTING) && !(ds & RenderDevice::DS_LIGHTING_GOURAUD)) {
+            features |= SF_LIGHTING;
+        }
+        return features;
+    }
+
+    int shade_attributes(int features, int* attrs)
+    {
+        int n = 0;
+        attrs[n++] = ATTR_INVW;
+        if (features & SF_TEXTURE) {
+            attrs[n++] = ATTR_U;
+            attrs[n++] = ATTR_V;
+        }
+        if (features & (SF_COLOR | SF_MODULATE)) {
+            attrs[n++] = ATTR_R;
+            attrs[n++] = ATTR_G;
+            attrs[n++] = ATTR_B;
+        }
+        if (features & SF_LIGHTING) {
+            for (int a = ATTR_WX; a <= ATTR_NZ; a++) attrs[n++] = a;
+        }
+        return n;
+    }
+
+    /*
+     * Every kernel is a template on the SF_* features and only reads the
+     * attributes shade_attributes() lists for them. All kernels compute pixel i of
+     * a segment as start + i * step rather than by repeated addition, and follow
+     * the same order of operations (including the clamping done by Color), so the
+     * vector kernels match the scalar one.
+     */
+    template <int F>
+    static int shade_pixels_scalar(const SpanSegment& seg, const ShadingState& st, int first)
+    {
+        int written = 0;
+
+        for (int i = first; i < seg.count; i++) {
+            Real invw = seg.start[ATTR_INVW] + (Real)i * seg.step[ATTR_INVW];
+            if (seg.depth_test && !(invw >= seg.depth[i])) continue;
+
+            written++;
+            seg.depth[i] = invw;
+            if (!(F & (SF_COLOR | SF_TEXTURE))) continue;
+#define ATTR(a) (seg.start[a] + (Real)i * seg.step[a])
+
+            Color tex_color;
+            if (F & SF_TEXTURE) {
+                tex_color = sample_texture<F>(seg, st, ATTR(ATTR_U), ATTR(ATTR_V));
+            }
+
+            Color vcolor;
+            if (F & (SF_COLOR | SF_MODULATE)) {
+                vcolor = Color(ATTR(ATTR_R), ATTR(ATTR_G), ATTR(ATTR_B));
+            }
+
+            if (F & SF_LIGHTING) {
+                Vector4 world_pos = Vector4(ATTR(ATTR_WX), ATTR(ATTR_WY), ATTR(ATTR_WZ));
+                Vector4 normal = Vector4(ATTR(ATTR_NX), ATTR(ATTR_NY), ATTR(ATTR_NZ));
+
+                normal.normalize();
+
+                Vector4 light_dir = world_pos - st.light_world_pos;
+                light_dir.normalize();
+
+                Real kdiffuse = light_dir.dot_product(normal);
+                if (kdiffuse < 0) kdiffuse = 0;
+
+                Color diffuse = st.material_diffuse * kdiffuse + st.diffuse_color * kdiffuse;
+
+                Color lcolor = diffuse + st.ambient_color;
+
+                if (F & SF_COLOR) {
+                    vcolor = vcolor * lcolor;
+                } else {
+                    tex_color = tex_color * lcolor;
+                }
+            } else if (F & SF_MODULATE) {
+                /* the lit vertex colors, or without DS_COLOR the light itself */
+                tex_color = tex_color * vcolor;
+            }
+#undef ATTR
+
+            seg.color[i] = (F & SF_COLOR) ? vcolor.color_value() : tex_color.color_value();
+        }
+
+        return written;
+    }
+
+    template <int F>
+    static int shade_span_scalar(const SpanSegment& seg, const ShadingState& st)
+    {
+        return shade_pixels_scalar<F>(seg, st, seg.first);
+    }
+
+    /*
+     * Fixed-point color path. Color channels are 8.8 fixed point in 32-bit integers
+     * (1.0 is 0xff00), pixel i of a segment gets base + i * step with both converted
+     * once per segment, and lighting scales them by an integer factor where 256 is
+     * 1.0; under DS_LIGHTING_GOURAUD without DS_COLOR the interpolated color is that
+     * factor for the texture. Nothing is clamped until the color is packed. Depth, texture coordinates
+     * and the diffuse term stay float; every fixed-point kernel gives the same result.
+     */
+    static const Real FIXED_COLOR_SCALE = 255 << 8;
+    static const Real FIXED_LIGHT_ONE = 256;
+
+    struct FixedSegment {
+        int32_t base[3];
+        int32_t step[3];
+        /* light factor = min(kd * diffuse + ambient, FIXED_LIGHT_ONE) per channel */
+        Real diffuse[3];
+        Real ambient[3];
+    };
+
+    template <int F>
+    static inline void setup_fixed_segment(FixedSegment& fs, const SpanSegment& seg, const ShadingState& st)
+    {
+        Real scale = (F & SF_MODULATE) ? FIXED_LIGHT_ONE : FIXED_COLOR_SCALE;
+        for (int c = 0; c < 3; c++) {
+            fs.base[c] = (F & (SF_COLOR | SF_MODULATE)) ? (int32_t)(seg.start[ATTR_R + c] * scale) : 0;
+            fs.step[c] = (F & (SF_COLOR | SF_MODULATE)) ? (int32_t)(seg.step[ATTR_R + c] * scale) : 0;
+        }
+        if (!(F & SF_LIGHTING)) return;
+
+        fs.diffuse[0] = (st.material_diffuse.r + st.diffuse_color.r) * FIXED_LIGHT_ONE;
+        fs.diffuse[1] = (st.material_diffuse.g + st.diffuse_color.g) * FIXED_LIGHT_ONE;
+        fs.diffuse[2] = (st.material_diffuse.b + st.diffuse_color.b) * FIXED_LIGHT_ONE;
+        fs.ambient[0] = st.ambient_color.r * FIXED_LIGHT_ONE;
+        fs.ambient[1] = st.ambient_color.g * FIXED_LIGHT_ONE;
+        fs.ambient[2] = st.ambient_color.b * FIXED_LIGHT_ONE;
+    }
+
+    static inline void normalize3(Real& x, Real& y, Real& z)
+    {
+        Real len = std::sqrt((x * x + y * y) + z * z);
+        Real inv = len != 0 ? 1 / len : 1;
+        x *= inv;
+        y *= inv;
+        z *= inv;
+    }
+
+    static inline uint32_t pack_fixed(int32_t r, int32_t g, int32_t b)
+    {
+        r = CLAMP(r >> 8, 0, 255);
+        g = CLAMP(g >> 8, 0, 255);
+        b = CLAMP(b >> 8, 0, 255);
+        return (r << 16) | (g << 8) | b;
+    }
+
+    template <int F>
+    static int shade_pixels_fixed(const SpanSegment& seg, const ShadingState& st, const FixedSegment& fs, int first)
+    {
+        int written = 0;
+
+        for (int i = first; i < seg.count; i++) {
+            Real invw = seg.start[ATTR_INVW] + (Real)i * seg.step[ATTR_INVW];
+            if (seg.depth_test && !(invw >= seg.depth[i])) continue;
+
+            written++;
+            seg.depth[i] = invw;
+            if (!(F & (SF_COLOR | SF_TEXTURE))) continue;
+#define ATTR(a) (seg.start[a] + (Real)i * seg.step[a])
+
+            int32_t c[3];
+            if (F & SF_TEXTURE) {
+                uint32_t texel = sample_nearest(st, seg.lod, ATTR(ATTR_U), ATTR(ATTR_V));
+                c[0] = ((texel >> 16) & 0xff) << 8;
+                c[1] = ((texel >> 8) & 0xff) << 8;
+                c[2] = (texel & 0xff) << 8;
+                if (F & SF_MODULATE) {
+                    for (int k = 0; k < 3; k++) c[k] = (c[k] * (fs.base[k] + i * fs.step[k])) >> 8;
+                }
+            } else {
+                for (int k = 0; k < 3; k++) c[k] = fs.base[k] + i * fs.step[k];
+            }
+
+            if (F & SF_LIGHTING) {
+                Real nx = ATTR(ATTR_NX), ny = ATTR(ATTR_NY), nz = ATTR(ATTR_NZ);
+                normalize3(nx, ny, nz);
+
+                Real lx = ATTR(ATTR_WX) - st.light_world_pos.x;
+                Real ly = ATTR(ATTR_WY) - st.light_world_pos.y;
+                Real lz = ATTR(ATTR_WZ) - st.light_world_pos.z;
+                normalize3(lx, ly, lz);
+
+                Real kd = (lx * nx + ly * ny) + lz * nz;
+                if (!(kd > 0)) kd = 0;
+
+                for (int k = 0; k < 3; k++) {
+                    Real light = std::min(kd * fs.diffuse[k] + fs.ambient[k], FIXED_LIGHT_ONE);
+                    c[k] = (c[k] * (int32_t)light) >> 8;
+                }
+            }
+#undef ATTR
+
+            seg.color[i] = pack_fixed(c[0], c[1], c[2]);
+        }
+
+        return written;
+    }
+
+    template <int F>
+    static int shade_span_fixed(const SpanSegment& seg, const ShadingState& st)
+    {
+        FixedSegment fs;
+        setup_fixed_segment<F>(fs, seg, st);
+        return shade_pixels_fixed<F>(seg, st, fs, seg.first);
+    }
+
+#ifdef HAVE_X86_SIMD
+
+    __attribute__((target("sse4.1")))
+    static inline __m128 clamp01_sse41(__m128 x)
+    {
+        return _mm_min_ps(_mm_max_ps(x, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+    }
+
+    __attribute__((target("sse4.1")))
+    static inline void normalize_sse41(__m128& x, __m128& y, __m128& z)
+    {
+        __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+        __m128 nonzero = _mm_cmpneq_ps(len, _mm_setzero_ps());
+        __m128 inv = _mm_blendv_ps(_mm_set1_ps(1.0f), _mm_div_ps(_mm_set1_ps(1.0f), len), nonzero);
+        x = _mm_mul_ps(x, inv);
+        y = _mm_mul_ps(y, inv);
+        z = _mm_mul_ps(z, inv);
+    }
+
+    __attribute__((target("sse4.1")))
+    static inline __m128i pack_color_sse41(__m128 r, __m128 g, __m128 b)
+    {
+        __m128 scale = _mm_set1_ps(255.0f);
+        __m128i ri = _mm_cvttps_epi32(_mm_mul_ps(r, scale));
+        __m128i gi = _mm_cvttps_epi32(_mm_mul_ps(g, scale));
+        __m128i bi = _mm_cvttps_epi32(_mm_mul_ps(b, scale));
+        return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(ri, 16), _mm_slli_epi32(gi, 8)), bi);
+    }
+
+    /* 4 pixels per iteration, the ragged end of the segment goes to the scalar kernel */
+    template <int F>
+    __attribute__((target("sse4.1")))
+    static int shade_span_sse41(const SpanSegment& seg, const ShadingState& st)
+    {
+        const bool textured = F & SF_TEXTURE;
+        const uint32_t* texels = textured ? st.texture->levels[seg.lod] : nullptr;
+        const int tex_w = textured ? level_size(st.texture->width, seg.lod) : 0;
+        const int tex_h = textured ? level_size(st.texture->height, seg.lod) : 0;
+        const __m128 lane = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+        const __m128 zero = _mm_setzero_ps();
+        int written = 0;
+        int i;
+
+        for (i = seg.first; i + 4 <= seg.count; i += 4) {
+            __m128 fi = _mm_add_ps(_mm_set1_ps((Real)i), lane);
+#define ATTR(a) _mm_add_ps(_mm_set1_ps(seg.start[a]), _mm_mul_ps(fi, _mm_set1_ps(seg.step[a])))
+
+            __m128 invw = ATTR(ATTR_INVW);
+            __m128 pass = _mm_castsi128_ps(_mm_set1_epi32(-1));
+            if (seg.depth_test) {
+                __m128 z = _mm_loadu_ps(seg.depth + i);
+                pass = _mm_cmpge_ps(invw, z);
+                int bits = _mm_movemask_ps(pass);
+                if (!bits) continue;
+
+                written += __builtin_popcount(bits);
+                _mm_storeu_ps(seg.depth + i, _mm_blendv_ps(z, invw, pass));
+            } else {
+                written += 4;
+                _mm_storeu_ps(seg.depth + i, invw);
+            }
+            if (!(F & (SF_COLOR | SF_TEXTURE))) continue;
+
+            __m128 r, g, b;
+            if (textured) {
+                __m128 u = _mm_mul_ps(ATTR(ATTR_U), _mm_set1_ps((Real)(tex_w - 1)));
+                __m128 v = _mm_mul_ps(ATTR(ATTR_V), _mm_set1_ps((Real)(tex_h - 1)));
+                __m128i ui = _mm_cvttps_epi32(_mm_blendv_ps(_mm_ceil_ps(u), _mm_floor_ps(u), _mm_cmplt_ps(u, zero)));
+                __m128i vi = _mm_cvttps_epi32(_mm_blendv_ps(_mm_ceil_ps(v), _mm_floor_ps(v), _mm_cmplt_ps(v, zero)));
+                ui = _mm_max_epi32(_mm_min_epi32(ui, _mm_set1_epi32(tex_w - 1)), _mm_setzero_si128());
+                vi = _mm_max_epi32(_mm_min_epi32(vi, _mm_set1_epi32(tex_h - 1)), _mm_setzero_si128());
+
+                int us[4], vs[4];
+                _mm_storeu_si128((__m128i*)us, ui);
+                _mm_storeu_si128((__m128i*)vs, vi);
+                __m128i texel = _mm_setr_epi32(texels[vs[0] * tex_w + us[0]], texels[vs[1] * tex_w + us[1]],
+                                               texels[vs[2] * tex_w + us[2]], texels[vs[3] * tex_w + us[3]]);
+
+                __m128i mask = _mm_set1_epi32(0xff);
+                __m128 c255 = _mm_set1_ps(255.0f);
+                r = _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(texel, 16), mask)), c255);
+                g = _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(texel, 8), mask)), c255);
+                b = _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(texel, mask)), c255);
+                if (F & SF_MODULATE) {
+                    r = clamp01_sse41(_mm_mul_ps(r, clamp01_sse41(ATTR(ATTR_R))));
+                    g = clamp01_sse41(_mm_mul_ps(g, clamp01_sse41(ATTR(ATTR_G))));
+                    b = clamp01_sse41(_mm_mul_ps(b, clamp01_sse41(ATTR(ATTR_B))));
+                }
+            } else {
+                r = clamp01_sse41(ATTR(ATTR_R));
+                g = clamp01_sse41(ATTR(ATTR_G));
+                b = clamp01_sse41(ATTR(ATTR_B));
+            }
+
+            if (F & SF_LIGHTING) {
+                __m128 nx = ATTR(ATTR_NX), ny = ATTR(ATTR_NY), nz = ATTR(ATTR_NZ);
+                normalize_sse41(nx, ny, nz);
+
+                __m128 lx = _mm_sub_ps(ATTR(ATTR_WX), _mm_set1_ps(st.light_world_pos.x));
+                __m128 ly = _mm_sub_ps(ATTR(ATTR_WY), _mm_set1_ps(st.light_world_pos.y));
+                __m128 lz = _mm_sub_ps(ATTR(ATTR_WZ), _mm_set1_ps(st.light_world_pos.z));
+                normalize_sse41(lx, ly, lz);
+
+                __m128 kd = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, nx), _mm_mul_ps(ly, ny)), _mm_mul_ps(lz, nz));
+                kd = _mm_max_ps(kd, zero);
+
+#define LIGHT_CHANNEL(c, ch) \
+                c = clamp01_sse41(_mm_mul_ps(c, clamp01_sse41(_mm_add_ps(clamp01_sse41(_mm_add_ps( \
+                        clamp01_sse41(_mm_mul_ps(_mm_set1_ps(st.material_diffuse.ch), kd)), \
+                        clamp01_sse41(_mm_mul_ps(_mm_set1_ps(st.diffuse_color.ch), kd)))), \
+                        _mm_set1_ps(st.ambient_color.ch)))))
+                LIGHT_CHANNEL(r, r);
+                LIGHT_CHANNEL(g, g);
+                LIGHT_CHANNEL(b, b);
+#undef LIGHT_CHANNEL
+            }
+#undef ATTR
+
+            __m128i color = pack_color_sse41(r, g, b);
+            if (seg.depth_test) {
+                __m128i old = _mm_loadu_si128((__m128i*)(seg.color + i));
+                color = _mm_blendv_epi8(old, color, _mm_castps_si128(pass));
+            }
+            _mm_storeu_si128((__m128i*)(seg.color + i), color);
+        }
+
+        return written + shade_pixels_scalar<F>(seg, st, i);
+    }
+
+    __attribute__((target("avx2")))
+    static inline __m256 clamp01_avx2(__m256 x)
+    {
+        return _mm256_min_ps(_mm256_max_ps(x, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+    }
+
+    __attribute__((target("avx2")))
+    static inline void normalize_avx2(__m256& x, __m256& y, __m256& z)
+    {
+        __m256 len = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z)));
+        __m256 nonzero = _mm256_cmp_ps(len, _mm256_setzero_ps(), _CMP_NEQ_UQ);
+        __m256 inv = _mm256_blendv_ps(_mm256_set1_ps(1.0f), _mm256_div_ps(_mm256_set1_ps(1.0f), len), nonzero);
+        x = _mm256_mul_ps(x, inv);
+        y = _mm256_mul_ps(y, inv);
+        z = _mm256_mul_ps(z, inv);
+    }
+
+    __attribute__((target("avx2")))
+    static inline __m256i pack_color_avx2(__m256 r, __m256 g, __m256 b)
+    {
+        __m256 scale = _mm256_set1_ps(255.0f);
+        __m256i ri = _mm256_cvttps_epi32(_mm256_mul_ps(r, scale));
+        __m256i gi = _mm256_cvttps_epi32(_mm256_mul_ps(g, scale));
+        __m256i bi = _mm256_cvttps_epi32(_mm256_mul_ps(b, scale));
+        return _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(ri, 16), _mm256_slli_epi32(gi, 8)), bi);
+    }
+
+    /* 8 pixels per iteration, the ragged end of the segment is handled with masked loads and stores */
+    template <int F>
+    __attribute__((target("avx2")))
+    static int shade_span_avx2(const SpanSegment& seg, const ShadingState& st)
+    {
+        const bool textured = F & SF_TEXTURE;
+        const uint32_t* texels = textured ? st.texture->levels[seg.lod] : nullptr;
+        const int tex_w = textured ? level_size(st.texture->width, seg.lod) : 0;
+        const int tex_h = textured ? level_size(st.texture->height, seg.lod) : 0;
+        const __m256 lane = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+        const __m256i lane_i = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m256 zero = _mm256_setzero_ps();
+        int written = 0;
+
+        for (int i = seg.first; i < seg.count; i += 8) {
+            __m256 fi = _mm256_add_ps(_mm256_set1_ps((Real)i), lane);
+#define ATTR(a) _mm256_add_ps(_mm256_set1_ps(seg.start[a]), _mm256_mul_ps(fi, _mm256_set1_ps(seg.step[a])))
+
+            __m256i live = _mm256_cmpgt_epi32(_mm256_set1_epi32(seg.count - i), lane_i);
+            __m256 invw = ATTR(ATTR_INVW);
+            __m256 pass = _mm256_castsi256_ps(live);
+            if (seg.depth_test) {
+                __m256 z = _mm256_maskload_ps(seg.depth + i, live);
+                pass = _mm256_and_ps(_mm256_cmp_ps(invw, z, _CMP_GE_OQ), pass);
+            }
+            int bits = _mm256_movemask_ps(pass);
+            if (!bits) continue;
+            written += __builtin_popcount(bits);
+
+            __m256i pass_i = _mm256_castps_si256(pass);
+            _mm256_maskstore_ps(seg.depth + i, pass_i, invw);
+            if (!(F & (SF_COLOR | SF_TEXTURE))) continue;
+
+            __m256 r, g, b;
+            if (textured) {
+                __m256 u = _mm256_mul_ps(ATTR(ATTR_U), _mm256_set1_ps((Real)(tex_w - 1)));
+                __m256 v = _mm256_mul_ps(ATTR(ATTR_V), _mm256_set1_ps((Real)(tex_h - 1)));
+                __m256i ui = _mm256_cvttps_epi32(_mm256_blendv_ps(_mm256_ceil_ps(u), _mm256_floor_ps(u), _mm256_cmp_ps(u, zero, _CMP_LT_OQ)));
+                __m256i vi = _mm256_cvttps_epi32(_mm256_blendv_ps(_mm256_ceil_ps(v), _mm256_floor_ps(v), _mm256_cmp_ps(v, zero, _CMP_LT_OQ)));
+                ui = _mm256_max_epi32(_mm256_min_epi32(ui, _mm256_set1_epi32(tex_w - 1)), _mm256_setzero_si256());
+                vi = _mm256_max_epi32(_mm256_min_epi32(vi, _mm256_set1_epi32(tex_h - 1)), _mm256_setzero_si256());
+
+                int us[8], vs[8];
+                uint32_t ts[8];
+                _mm256_storeu_si256((__m256i*)us, ui);
+                _mm256_storeu_si256((__m256i*)vs, vi);
+                for (int k = 0; k < 8; k++) ts[k] = texels[vs[k] * tex_w + us[k]];
+                __m256i texel = _mm256_loadu_si256((const __m256i*)ts);
+
+                __m256i mask = _mm256_set1_epi32(0xff);
+                __m256 c255 = _mm256_set1_ps(255.0f);
+                r = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texel, 16), mask)), c255);
+                g = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texel, 8), mask)), c255);
+                b = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(texel, mask)), c255);
+                if (F & SF_MODULATE) {
+                    r = clamp01_avx2(_mm256_mul_ps(r, clamp01_avx2(ATTR(ATTR_R))));
+                    g = clamp01_avx2(_mm256_mul_ps(g, clamp01_avx2(ATTR(ATTR_G))));
+                    b = clamp01_avx2(_mm256_mul_ps(b, clamp01_avx2(ATTR(ATTR_B))));
+                }
+            } else {
+                r = clamp01_avx2(ATTR(ATTR_R));
+                g = clamp01_avx2(ATTR(ATTR_G));
+                b = clamp01_avx2(ATTR(ATTR_B));
+            }
+
+            if (F & SF_LIGHTING) {
+                __m256 nx = ATTR(ATTR_NX), ny = ATTR(ATTR_NY), nz = ATTR(ATTR_NZ);
+                normalize_avx2(nx, ny, nz);
+
+                __m256 lx = _mm256_sub_ps(ATTR(ATTR_WX), _mm256_set1_ps(st.light_world_pos.x));
+                __m256 ly = _mm256_sub_ps(ATTR(ATTR_WY), _mm256_set1_ps(st.light_world_pos.y));
+                __m256 lz = _mm256_sub_ps(ATTR(ATTR_WZ), _mm256_set1_ps(st.light_world_pos.z));
+                normalize_avx2(lx, ly, lz);
+
+                __m256 kd = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, nx), _mm256_mul_ps(ly, ny)), _mm256_mul_ps(lz, nz));
+                kd = _mm256_max_ps(kd, zero);
+
+#define LIGHT_CHANNEL(c, ch) \
+                c = clamp01_avx2(_mm256_mul_ps(c, clamp01_avx2(_mm256_add_ps(clamp01_avx2(_mm256_add_ps( \
+                        clamp01_avx2(_mm256_mul_ps(_mm256_set1_ps(st.material_diffuse.ch), kd)), \
+                        clamp01_avx2(_mm256_mul_ps(_mm256_set1_ps(st.diffuse_color.ch), kd)))), \
+                        _mm256_set1_ps(st.ambient_color.ch)))))
+                LIGHT_CHANNEL(r, r);
+                LIGHT_CHANNEL(g, g);
+                LIGHT_CHANNEL(b, b);
+#undef LIGHT_CHANNEL
+            }
+#undef ATTR
+
+            _mm256_maskstore_epi32((int*)(seg.color + i), pass_i, pack_color_avx2(r, g, b));
+        }
+
+        return written;
+    }
+
+    __attribute__((target("sse4.1")))
+    static inline __m128i pack_fixed_sse41(__m128i r, __m128i g, __m128i b)
+    {
+        __m128i zero = _mm_setzero_si128(), max = _mm_set1_epi32(255);
+        r = _mm_min_epi32(_mm_max_epi32(_mm_srai_epi32(r, 8), zero), max);
+        g = _mm_min_epi32(_mm_max_epi32(_mm_srai_epi32(g, 8), zero), max);
+        b = _mm_min_epi32(_mm_max_epi32(_mm_srai_epi32(b, 8), zero), max);
+        return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r, 16), _mm_slli_epi32(g, 8)), b);
+    }
+
+    template <int F>
+    __attribute__((target("sse4.1")))
+    static int shade_span_fixed_sse41(const SpanSegment& seg, const ShadingState& st)
+    {
+        const bool textured = F & SF_TEXTURE;
+        const uint32_t* texels = textured ? st.texture->levels[seg.lod] : nullptr;
+        const int tex_w = textured ? level_size(st.texture->width, seg.lod) : 0;
+        const int tex_h = textured ? level_size(st.texture->height, seg.lod) : 0;
+        const __m128 lane = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+        const __m128i lane_i = _mm_setr_epi32(0, 1, 2, 3);
+        const __m128 zero = _mm_setzero_ps();
+
+        FixedSegment fs;
+        setup_fixed_segment<F>(fs, seg, st);
+        int written = 0;
+        int i;
+
+        /* integer stepping is exact, so base + i * step is kept up to date by adding */
+        __m128i first = _mm_add_epi32(_mm_set1_epi32(seg.first), lane_i);
+        __m128i cr = _mm_add_epi32(_mm_set1_epi32(fs.base[0]), _mm_mullo_epi32(first, _mm_set1_epi32(fs.step[0])));
+        __m128i cg = _mm_add_epi32(_mm_set1_epi32(fs.base[1]), _mm_mullo_epi32(first, _mm_set1_epi32(fs.step[1])));
+        __m128i cb = _mm_add_epi32(_mm_set1_epi32(fs.base[2]), _mm_mullo_epi32(first, _mm_set1_epi32(fs.step[2])));
+        const __m128i dr = _mm_set1_epi32(fs.step[0] * 4);
+        const __m128i dg = _mm_set1_epi32(fs.step[1] * 4);
+        const __m128i db = _mm_set1_epi32(fs.step[2] * 4);
+
+        for (i = seg.first; i + 4 <= seg.count; i += 4, cr = _mm_add_epi32(cr, dr),
+                 cg = _mm_add_epi32(cg, dg), cb = _mm_add_epi32(cb, db)) {
+            __m128 fi = _mm_add_ps(_mm_set1_ps((Real)i), lane);
+#define ATTR(a) _mm_add_ps(_mm_set1_ps(seg.start[a]), _mm_mul_ps(fi, _mm_set1_ps(seg.step[a])))
+
+            __m128 invw = ATTR(ATTR_INVW);
+            __m128 pass = _mm_castsi128_ps(_mm_set1_epi32(-1));
+            if (seg.depth_test) {
+                __m128 z = _mm_loadu_ps(seg.depth + i);
+                pass = _mm_cmpge_ps(invw, z);
+                int bits = _mm_movemask_ps(pass);
+                if (!bits) continue;
+
+                written += __builtin_popcount(bits);
+                _mm_storeu_ps(seg.depth + i, _mm_blendv_ps(z, invw, pass));
+            } else {
+                written += 4;
+                _mm_storeu_ps(seg.depth + i, invw);
+            }
+            if (!(F & (SF_COLOR | SF_TEXTURE))) continue;
+
+            __m128i r, g, b;
+            if (textured) {
+                __m128 u = _mm_mul_ps(ATTR(ATTR_U), _mm_set1_ps((Real)(tex_w - 1)));
+                __m128 v = _mm_mul_ps(ATTR(ATTR_V), _mm_set1_ps((Real)(tex_h - 1)));
+                __m128i ui = _mm_cvttps_epi32(_mm_blendv_ps(_mm_ceil_ps(u), _mm_floor_ps(u), _mm_cmplt_ps(u, zero)));
+                __m128i vi = _mm_cvttps_epi32(_mm_blendv_ps(_mm_ceil_ps(v), _mm_floor_ps(v), _mm_cmplt_ps(v, zero)));
+                ui = _mm_max_epi32(_mm_min_epi32(ui, _mm_set1_epi32(tex_w - 1)), _mm_setzero_si128());
+                vi = _mm_max_epi32(_mm_min_epi32(vi, _mm_set1_epi32(tex_h - 1)), _mm_setzero_si128());
+
+                int us[4], vs[4];
+                _mm_storeu_si128((__m128i*)us, ui);
+                _mm_storeu_si128((__m128i*)vs, vi);
+                __m128i texel = _mm_setr_epi32(texels[vs[0] * tex_w + us[0]], texels[vs[1] * tex_w + us[1]],
+                                               texels[vs[2] * tex_w + us[2]], texels[vs[3] * tex_w + us[3]]);
+
+                __m128i mask = _mm_set1_epi32(0xff00);
+                r = _mm_and_si128(_mm_srli_epi32(texel, 8), mask);
+                g = _mm_and_si128(texel, mask);
+                b = _mm_and_si128(_mm_slli_epi32(texel, 8), mask);
+                if (F & SF_MODULATE) {
+                    r = _mm_srai_epi32(_mm_mullo_epi32(r, cr), 8);
+                    g = _mm_srai_epi32(_mm_mullo_epi32(g, cg), 8);
+                    b = _mm_srai_epi32(_mm_mullo_epi32(b, cb), 8);
+                }
+            } else {
+                r = cr;
+                g = cg;
+                b = cb;
+            }
+
+            if (F & SF_LIGHTING) {
+                __m128 nx = ATTR(ATTR_NX), ny = ATTR(ATTR_NY), nz = ATTR(ATTR_NZ);
+                normalize_sse41(nx, ny, nz);
+
+                __m128 lx = _mm_sub_ps(ATTR(ATTR_WX), _mm_set1_ps(st.light_world_pos.x));
+                __m128 ly = _mm_sub_ps(ATTR(ATTR_WY), _mm_set1_ps(st.light_world_pos.y));
+                __m128 lz = _mm_sub_ps(ATTR(ATTR_WZ), _mm_set1_ps(st.light_world_pos.z));
+                normalize_sse41(lx, ly, lz);
+
+                __m128 kd = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, nx), _mm_mul_ps(ly, ny)), _mm_mul_ps(lz, nz));
+                kd = _mm_max_ps(kd, zero);
+
+#define LIGHT_CHANNEL(c, k) \
+                c = _mm_srai_epi32(_mm_mullo_epi32(c, _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps( \
+                        _mm_mul_ps(kd, _mm_set1_ps(fs.diffuse[k])), _mm_set1_ps(fs.ambient[k])), \
+                        _mm_set1_ps(FIXED_LIGHT_ONE)))), 8)
+                LIGHT_CHANNEL(r, 0);
+                LIGHT_CHANNEL(g, 1);
+                LIGHT_CHANNEL(b, 2);
+#undef LIGHT_CHANNEL
+            }
+#undef ATTR
+
+            __m128i color = pack_fixed_sse41(r, g, b);
+            if (seg.depth_test) {
+                __m128i old = _mm_loadu_si128((__m128i*)(seg.color + i));
+                color = _mm_blendv_epi8(old, color, _mm_castps_si128(pass));
+            }
+            _mm_storeu_si128((__m128i*)(seg.color + i), color);
+        }
+
+        return written + shade_pixels_fixed<F>(seg, st, fs, i);
+    }
+
+    __attribute__((target("avx2")))
+    static inline __m256i pack_fixed_avx2(__m256i r, __m256i g, __m256i b)
+    {
+        __m256i zero = _mm256_setzero_si256(), max = _mm256_set1_epi32(255);
+        r = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(r, 8), zero), max);
+        g = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(g, 8), zero), max);
+        b = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(b, 8), zero), max);
+        return _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(r, 16), _mm256_slli_epi32(g, 8)), b);
+    }
+
+    template <int F>
+    __attribute__((target("avx2")))
+    static int shade_span_fixed_avx2(const SpanSegment& seg, const ShadingState& st)
+    {
+        const bool textured = F & SF_TEXTURE;
+        const uint32_t* texels = textured ? st.texture->levels[seg.lod] : nullptr;
+        const int tex_w = textured ? level_size(st.texture->width, seg.lod) : 0;
+        const int tex_h = textured ? level_size(st.texture->height, seg.lod) : 0;
+        const __m256 lane = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+        const __m256i lane_i = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m256 zero = _mm256_setzero_ps();
+
+        FixedSegment fs;
+        setup_fixed_segment<F>(fs, seg, st);
+        int written = 0;
+
+        /* integer stepping is exact, so base + i * step is kept up to date by adding */
+        __m256i first = _mm256_add_epi32(_mm256_set1_epi32(seg.first), lane_i);
+        __m256i cr = _mm256_add_epi32(_mm256_set1_epi32(fs.base[0]), _mm256_mullo_epi32(first, _mm256_set1_epi32(fs.step[0])));
+        __m256i cg = _mm256_add_epi32(_mm256_set1_epi32(fs.base[1]), _mm256_mullo_epi32(first, _mm256_set1_epi32(fs.step[1])));
+        __m256i cb = _mm256_add_epi32(_mm256_set1_epi32(fs.base[2]), _mm256_mullo_epi32(first, _mm256_set1_epi32(fs.step[2])));
+        const __m256i dr = _mm256_set1_epi32(fs.step[0] * 8);
+        const __m256i dg = _mm256_set1_epi32(fs.step[1] * 8);
+        const __m256i db = _mm256_set1_epi32(fs.step[2] * 8);
+
+        for (int i = seg.first; i < seg.count; i += 8, cr = _mm256_add_epi32(cr, dr),
+                 cg = _mm256_add_epi32(cg, dg), cb = _mm256_add_epi32(cb, db)) {
+            __m256 fi = _mm256_add_ps(_mm256_set1_ps((Real)i), lane);
+#define ATTR(a) _mm256_add_ps(_mm256_set1_ps(seg.start[a]), _mm256_mul_ps(fi, _mm256_set1_ps(seg.step[a])))
+
+            __m256i live = _mm256_cmpgt_epi32(_mm256_set1_epi32(seg.count - i), lane_i);
+            __m256 invw = ATTR(ATTR_INVW);
+            __m256 pass = _mm256_castsi256_ps(live);
+            if (seg.depth_test) {
+                __m256 z = _mm256_maskload_ps(seg.depth + i, live);
+                pass = _mm256_and_ps(_mm256_cmp_ps(invw, z, _CMP_GE_OQ), pass);
+            }
+            int bits = _mm256_movemask_ps(pass);
+            if (!bits) continue;
+            written += __builtin_popcount(bits);
+
+            __m256i pass_i = _mm256_castps_si256(pass);
+            _mm256_maskstore_ps(seg.depth + i, pass_i, invw);
+            if (!(F & (SF_COLOR | SF_TEXTURE))) continue;
+
+            __m256i r, g, b;
+            if (textured) {
+                __m256 u = _mm256_mul_ps(ATTR(ATTR_U), _mm256_set1_ps((Real)(tex_w - 1)));
+                __m256 v = _mm256_mul_ps(ATTR(ATTR_V), _mm256_set1_ps((Real)(tex_h - 1)));
+                __m256i ui = _mm256_cvttps_epi32(_mm256_blendv_ps(_mm256_ceil_ps(u), _mm256_floor_ps(u), _mm256_cmp_ps(u, zero, _CMP_LT_OQ)));
+                __m256i vi = _mm256_cvttps_epi32(_mm256_blendv_ps(_mm256_ceil_ps(v), _mm256_floor_ps(v), _mm256_cmp_ps(v, zero, _CMP_LT_OQ)));
+                ui = _mm256_max_epi32(_mm256_min_epi32(ui, _mm256_set1_epi32(tex_w - 1)), _mm256_setzero_si256());
+                vi = _mm256_max_epi32(_mm256_min_epi32(vi, _mm256_set1_epi32(tex_h - 1)), _mm256_setzero_si256());
+
+                /* lanes past the end hold clamped, in-bounds indices */
+                __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(vi, _mm256_set1_epi32(tex_w)), ui);
+                __m256i texel = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int*)texels, index, pass_i, 4);
+
+                __m256i mask = _mm256_set1_epi32(0xff00);
+                r = _mm256_and_si256(_mm256_srli_epi32(texel, 8), mask);
+                g = _mm256_and_si256(texel, mask);
+                b = _mm256_and_si256(_mm256_slli_epi32(texel, 8), mask);
+                if (F & SF_MODULATE) {
+                    r = _mm256_srai_epi32(_mm256_mullo_epi32(r, cr), 8);
+                    g = _mm256_srai_epi32(_mm256_mullo_epi32(g, cg), 8);
+                    b = _mm256_srai_epi32(_mm256_mullo_epi32(b, cb), 8);
+                }
+            } else {
+                r = cr;
+                g = cg;
+                b = cb;
+            }
+
+            if (F & SF_LIGHTING) {
+                __m256 nx = ATTR(ATTR_NX), ny = ATTR(ATTR_NY), nz = ATTR(ATTR_NZ);
+                normalize_avx2(nx, ny, nz);
+
+                __m256 lx = _mm256_sub_ps(ATTR(ATTR_WX), _mm256_set1_ps(st.light_world_pos.x));
+                __m256 ly = _mm256_sub_ps(ATTR(ATTR_WY), _mm256_set1_ps(st.light_world_pos.y));
+                __m256 lz = _mm256_sub_ps(ATTR(ATTR_WZ), _mm256_set1_ps(st.light_world_pos.z));
+                normalize_avx2(lx, ly, lz);
+
+                __m256 kd = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, nx), _mm256_mul_ps(ly, ny)), _mm256_mul_ps(lz, nz));
+                kd = _mm256_max_ps(kd, zero);
+
+#define LIGHT_CHANNEL(c, k) \
+                c = _mm256_srai_epi32(_mm256_mullo_epi32(c, _mm256_cvttps_epi32(_mm256_min_ps(_mm256_add_ps( \
+                        _mm256_mul_ps(kd, _mm256_set1_ps(fs.diffuse[k])), _mm256_set1_ps(fs.ambient[k])), \
+                        _mm256_set1_ps(FIXED_LIGHT_ONE)))), 8)
+                LIGHT_CHANNEL(r, 0);
+                LIGHT_CHANNEL(g, 1);
+                LIGHT_CHANNEL(b, 2);
+#undef LIGHT_CHANNEL
+            }
+#undef ATTR
+
+            _mm256_maskstore_epi32((int*)(seg.color + i), pass_i, pack_fixed_avx2(r, g, b));
+        }
+
+        return written;
+    }
+
+#endif
+
+    /* one instantiation per feature set, the point-sampling kernels only take the
+     * features below SF_LINEAR */
+    static const int POINT_FEATURES = SF_LINEAR;
+
+#define KERNELS_4(k, f) k<f>, k<f + 1>, k<f + 2>, k<f + 3>
+#define KERNELS_16(k, f) KERNELS_4(k, f), KERNELS_4(k, f + 4), KERNELS_4(k, f + 8), KERNELS_4(k, f + 12)
+    static const ShadeKernel scalar_kernels[SF_COUNT] = {
+        KERNELS_16(shade_span_scalar, 0), KERNELS_16(shade_span_scalar, 16),
+        KERNELS_16(shade_span_scalar, 32), KERNELS_16(shade_span_scalar, 48)
+    };
+    static const ShadeKernel fixed_kernels[POINT_FEATURES] = { KERNELS_16(shade_span_fixed, 0) };
+#ifdef HAVE_X86_SIMD
+    static const ShadeKernel sse41_kernels[POINT_FEATURES] = { KERNELS_16(shade_span_sse41, 0) };
+    static const ShadeKernel avx2_kernels[POINT_FEATURES] = { KERNELS_16(shade_span_avx2, 0) };
+    static const ShadeKernel fixed_sse41_kernels[POINT_FEATURES] = { KERNELS_16(shade_span_fixed_sse41, 0) };
+    static const ShadeKernel fixed_avx2_kernels[POINT_FEATURES] = { KERNELS_16(shade_span_fixed_avx2, 0) };
+#endif
+#undef KERNELS_16
+#undef KERNELS_4
+
+    void derive_shading_state(ShadingState& st, int level, int color_path)
+    {
+        st.features = shade_features(st);
+        st.kernel = select_shade_kernel(level, color_path, st.features);
+        st.attr_count = shade_attributes(st.features, st.attrs);
+    }
+
+    ShadeKernel select_shade_kernel(int level, int color_path, int features)
+    {
+        if (features >= POINT_FEATURES) return scalar_kernels[features];
+        bool fixed = color_path == RenderDevice::CP_FIXED;
+
+#ifdef HAVE_X86_SIMD
+        int supported = detect_simd_level();
+        if (level > supported) level = supported;
+
+        switch (level) {
+            case SIMD_AVX2:
+                return fixed ? fixed_avx2_kernels[features] : avx2_kernels[features];
+            case SIMD_SSE41:
+                return fixed ? fixed_sse41_kernels[features] : sse41_kernels[features];
+        }
+#else
+        (void)level;
+#endif
+        return fixed ? fixed_kernels[features] : scalar_kernels[features];
+    }
+}
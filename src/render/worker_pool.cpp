@@ -0,0 +1,85 @@
+#include "render/worker_pool.h"
+
+namespace fbrender {
+
+    WorkerPool::WorkerPool(int nthreads)
+    {
+        current_job = nullptr;
+        job_count = 0;
+        next_index = 0;
+        busy = 0;
+        generation = 0;
+        stopping = false;
+
+        for (int i = 1; i < nthreads; i++) {
+            threads.push_back(std::thread(&WorkerPool::worker_main, this));
+        }
+    }
+
+    WorkerPool::~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        start_cond.notify_all();
+
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+    }
+
+    void WorkerPool::run(size_t count, const std::function<void(size_t)>& job)
+    {
+        if (count == 0) return;
+
+        if (threads.empty()) {
+            for (size_t i = 0; i < count; i++) job(i);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            current_job = &job;
+            job_count = count;
+            next_index = 0;
+            busy = (int)threads.size();
+            generation++;
+        }
+        start_cond.notify_all();
+
+        work();
+
+        std::unique_lock<std::mutex> guard(lock);
+        done_cond.wait(guard, [this] { return busy == 0; });
+        current_job = nullptr;
+    }
+
+    void WorkerPool::work()
+    {
+        /* iterations are handed out one at a time so uneven tiles balance out */
+        size_t i;
+        while ((i = next_index++) < job_count) {
+            (*current_job)(i);
+        }
+    }
+
+    void WorkerPool::worker_main()
+    {
+        unsigned seen = 0;
+
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                start_cond.wait(guard, [this, seen] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+
+            work();
+
+            std::lock_guard<std::mutex> guard(lock);
+            if (--busy == 0) done_cond.notify_one();
+        }
+    }
+}
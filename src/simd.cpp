@@ -0,0 +1,23 @@
+#include "simd.h"
+
+namespace fbrender {
+
+    int detect_simd_level()
+    {
+#ifdef HAVE_X86_SIMD
+        static int level = -1;
+
+        if (level < 0) {
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) level = SIMD_AVX2;
+            else if (__builtin_cpu_supports("sse4.1")) level = SIMD_SSE41;
+            else level = SIMD_NONE;
+        }
+
+        return level;
+#else
+        return SIMD_NONE;
+#endif
+    }
+
+}
@@ -1,5 +1,11 @@
 #include "transform.h"
+#include "simd.h"
 #include <iostream>
+
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 using namespace std;
 namespace fbrender {
 
@@ -13,12 +19,14 @@ namespace fbrender {
 
         this->width = width;
         this->height = height;
+        dirty = DIRTY_ALL;
         update();
     }
 
     Vertex Transform::apply_mv_transform(const Vertex& v)
     {
-        return Vertex(v.get_pos() * transform, v.get_texcoord(), v.get_color(), v.get_pos() * world, v.get_normal());
+        update();
+        return Vertex(v.get_pos() * world_view, v.get_texcoord(), v.get_color(), v.get_pos() * world, v.get_normal());
     }
 
     Vertex Transform::apply_projection(const Vertex& v)
@@ -38,9 +46,25 @@ namespace fbrender {
         return Vertex(pos, tex, color, world_pos, normal);
     }
 
-    void Transform::update()
+    void Transform::recompute()
     {
-        transform = world * view;
+        if (dirty & (DIRTY_WORLD | DIRTY_VIEW)) {
+            world_view = world * view;
+        }
+        if (dirty & (DIRTY_WORLD | DIRTY_VIEW | DIRTY_PROJECTION)) {
+            world_view_projection = world_view * projection;
+        }
+        if (dirty & DIRTY_WORLD) {
+            normal_matrix = world.inverse().transpose();
+        }
+        if (dirty & (DIRTY_WORLD | DIRTY_LIGHT)) {
+            light_world_pos = light_pos * world;
+        }
+        if (dirty & (DIRTY_WORLD | DIRTY_CAMERA)) {
+            camera_world_pos = camera_pos * world;
+        }
+
+        dirty = 0;
     }
 
     int Transform::check_cvv(const Vertex& v)
@@ -64,8 +88,8 @@ namespace fbrender {
     {
         Vector4 vec = v.get_pos();
         Real invecw = 1.0 / vec.w;
-        Real x = (vec.x * invecw + 1.0) * width * 0.5;
-        Real y = (1.0 - vec.y * invecw) * height * 0.5;
+        Real x = (vec.x * invecw + (Real)1.0) * width * (Real)0.5;
+        Real y = ((Real)1.0 - vec.y * invecw) * height * (Real)0.5;
         Real z = vec.z * invecw;
         Vertex r(Vector4(x, y, z, 1.0), v.get_texcoord(), v.get_color(), v.get_world_pos(), v.get_normal());
         r.set_one_per_w(invecw);
@@ -73,5 +97,185 @@ namespace fbrender {
         return r;
     }
 
-}
+    void Transform::transform_stream(const VertexStream& in, const TransformedStream& out)
+    {
+        update();
+
+        size_t done = 0;
+#ifdef HAVE_X86_SIMD
+        if (detect_simd_level() >= SIMD_AVX2) {
+            done = in.count & ~(size_t)7;
+            transform_stream_avx2(in, out, done);
+        }
+#endif
+        transform_stream_scalar(in, out, done);
+    }
+
+#define CLAMP01(x) ((x) < 0 ? 0 : ((x) > 1 ? 1 : (x)))
+
+    /* mirrors apply_mv_transform, apply_projection, check_cvv and homogenize
+     * operation for operation so both stream paths agree with the Vertex path */
+    void Transform::transform_stream_scalar(const VertexStream& in, const TransformedStream& out, size_t first)
+    {
+        for (size_t i = first; i < in.count; i++) {
+            Vector4 pos(in.x[i], in.y[i], in.z[i], 1.0);
+            Vector4 eye = pos * world_view;
+            Vector4 wpos = pos * world;
+            Vector4 clip = eye * projection;
+
+            Real invw = 1.0 / clip.w;
+
+            out.eye_x[i] = eye.x;
+            out.eye_y[i] = eye.y;
+            out.eye_z[i] = eye.z;
+
+            out.world_x[i] = wpos.x * invw;
+            out.world_y[i] = wpos.y * invw;
+            out.world_z[i] = wpos.z * invw;
+
+            if (out.nx && in.nx) {
+                Vector4 n = Vector4(in.nx[i], in.ny[i], in.nz[i], 0.0) * normal_matrix;
+                out.nx[i] = n.x * invw;
+                out.ny[i] = n.y * invw;
+                out.nz[i] = n.z * invw;
+            } else if (out.nx) {
+                out.nx[i] = out.ny[i] = out.nz[i] = 0;
+            }
+
+            out.u[i] = in.u ? in.u[i] * invw : 0;
+            out.v[i] = in.v ? in.v[i] * invw : 0;
+
+            if (in.r) {
+                Real r = CLAMP01(in.r[i]), g = CLAMP01(in.g[i]), b = CLAMP01(in.b[i]);
+                r *= invw;
+                g *= invw;
+                b *= invw;
+                out.r[i] = CLAMP01(r);
+                out.g[i] = CLAMP01(g);
+                out.b[i] = CLAMP01(b);
+            } else {
+                out.r[i] = out.g[i] = out.b[i] = 0;
+            }
+
+            out.clipped[i] = clip.z < 0.0 || clip.z > clip.w ||
+                             clip.x < -clip.w || clip.x > clip.w ||
+                             clip.y < -clip.w || clip.y > clip.w;
+
+            out.screen_x[i] = (clip.x * invw + (Real)1.0) * width * (Real)0.5;
+            out.screen_y[i] = ((Real)1.0 - clip.y * invw) * height * (Real)0.5;
+            out.screen_z[i] = clip.z * invw;
+            out.invw[i] = invw;
+        }
+    }
+
+#ifdef HAVE_X86_SIMD
 
+    __attribute__((target("avx2")))
+    void Transform::transform_stream_avx2(const VertexStream& in, const TransformedStream& out, size_t count)
+    {
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 one = _mm256_set1_ps(1.0f);
+
+#define ROW(mat, v0, v1, v2, c) \
+        _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(v0, _mm256_set1_ps(mat[0][c])), \
+                                                  _mm256_mul_ps(v1, _mm256_set1_ps(mat[1][c]))), \
+                                    _mm256_mul_ps(v2, _mm256_set1_ps(mat[2][c]))), \
+                      _mm256_set1_ps(mat[3][c]))
+/* directions have w = 0, so the translation row drops out */
+#define ROW3(mat, v0, v1, v2, c) \
+        _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(v0, _mm256_set1_ps(mat[0][c])), \
+                                    _mm256_mul_ps(v1, _mm256_set1_ps(mat[1][c]))), \
+                      _mm256_mul_ps(v2, _mm256_set1_ps(mat[2][c])))
+#define ROW4(mat, v0, v1, v2, v3, c) \
+        _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(v0, _mm256_set1_ps(mat[0][c])), \
+                                                  _mm256_mul_ps(v1, _mm256_set1_ps(mat[1][c]))), \
+                                    _mm256_mul_ps(v2, _mm256_set1_ps(mat[2][c]))), \
+                      _mm256_mul_ps(v3, _mm256_set1_ps(mat[3][c])))
+#define CLAMP01_PS(x) _mm256_min_ps(_mm256_max_ps(x, zero), one)
+
+        for (size_t i = 0; i < count; i += 8) {
+            __m256 x = _mm256_loadu_ps(in.x + i);
+            __m256 y = _mm256_loadu_ps(in.y + i);
+            __m256 z = _mm256_loadu_ps(in.z + i);
+
+            __m256 ex = ROW(world_view, x, y, z, 0);
+            __m256 ey = ROW(world_view, x, y, z, 1);
+            __m256 ez = ROW(world_view, x, y, z, 2);
+            __m256 ew = ROW(world_view, x, y, z, 3);
+
+            __m256 cx = ROW4(projection, ex, ey, ez, ew, 0);
+            __m256 cy = ROW4(projection, ex, ey, ez, ew, 1);
+            __m256 cz = ROW4(projection, ex, ey, ez, ew, 2);
+            __m256 cw = ROW4(projection, ex, ey, ez, ew, 3);
+
+            __m256 invw = _mm256_div_ps(one, cw);
+
+            _mm256_storeu_ps(out.eye_x + i, ex);
+            _mm256_storeu_ps(out.eye_y + i, ey);
+            _mm256_storeu_ps(out.eye_z + i, ez);
+
+            _mm256_storeu_ps(out.world_x + i, _mm256_mul_ps(ROW(world, x, y, z, 0), invw));
+            _mm256_storeu_ps(out.world_y + i, _mm256_mul_ps(ROW(world, x, y, z, 1), invw));
+            _mm256_storeu_ps(out.world_z + i, _mm256_mul_ps(ROW(world, x, y, z, 2), invw));
+
+            if (out.nx && in.nx) {
+                __m256 nx = _mm256_loadu_ps(in.nx + i);
+                __m256 ny = _mm256_loadu_ps(in.ny + i);
+                __m256 nz = _mm256_loadu_ps(in.nz + i);
+                _mm256_storeu_ps(out.nx + i, _mm256_mul_ps(ROW3(normal_matrix, nx, ny, nz, 0), invw));
+                _mm256_storeu_ps(out.ny + i, _mm256_mul_ps(ROW3(normal_matrix, nx, ny, nz, 1), invw));
+                _mm256_storeu_ps(out.nz + i, _mm256_mul_ps(ROW3(normal_matrix, nx, ny, nz, 2), invw));
+            } else if (out.nx) {
+                _mm256_storeu_ps(out.nx + i, zero);
+                _mm256_storeu_ps(out.ny + i, zero);
+                _mm256_storeu_ps(out.nz + i, zero);
+            }
+
+            _mm256_storeu_ps(out.u + i, in.u ? _mm256_mul_ps(_mm256_loadu_ps(in.u + i), invw) : zero);
+            _mm256_storeu_ps(out.v + i, in.v ? _mm256_mul_ps(_mm256_loadu_ps(in.v + i), invw) : zero);
+
+            if (in.r) {
+                _mm256_storeu_ps(out.r + i, CLAMP01_PS(_mm256_mul_ps(CLAMP01_PS(_mm256_loadu_ps(in.r + i)), invw)));
+                _mm256_storeu_ps(out.g + i, CLAMP01_PS(_mm256_mul_ps(CLAMP01_PS(_mm256_loadu_ps(in.g + i)), invw)));
+                _mm256_storeu_ps(out.b + i, CLAMP01_PS(_mm256_mul_ps(CLAMP01_PS(_mm256_loadu_ps(in.b + i)), invw)));
+            } else {
+                _mm256_storeu_ps(out.r + i, zero);
+                _mm256_storeu_ps(out.g + i, zero);
+                _mm256_storeu_ps(out.b + i, zero);
+            }
+
+            /* CVV outcodes, packed to one byte per vertex */
+            __m256 ncw = _mm256_sub_ps(zero, cw);
+            __m256 outside = _mm256_or_ps(
+                _mm256_or_ps(_mm256_cmp_ps(cz, zero, _CMP_LT_OQ), _mm256_cmp_ps(cz, cw, _CMP_GT_OQ)),
+                _mm256_or_ps(
+                    _mm256_or_ps(_mm256_cmp_ps(cx, ncw, _CMP_LT_OQ), _mm256_cmp_ps(cx, cw, _CMP_GT_OQ)),
+                    _mm256_or_ps(_mm256_cmp_ps(cy, ncw, _CMP_LT_OQ), _mm256_cmp_ps(cy, cw, _CMP_GT_OQ))));
+            int bits = _mm256_movemask_ps(outside);
+            for (int k = 0; k < 8; k++) {
+                out.clipped[i + k] = (bits >> k) & 1;
+            }
+
+            __m256 vw = _mm256_set1_ps(width);
+            __m256 vh = _mm256_set1_ps(height);
+            __m256 half = _mm256_set1_ps(0.5f);
+            _mm256_storeu_ps(out.screen_x + i, _mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(cx, invw), one), vw), half));
+            _mm256_storeu_ps(out.screen_y + i, _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(one, _mm256_mul_ps(cy, invw)), vh), half));
+            _mm256_storeu_ps(out.screen_z + i, _mm256_mul_ps(cz, invw));
+            _mm256_storeu_ps(out.invw + i, invw);
+        }
+#undef CLAMP01_PS
+#undef ROW4
+#undef ROW3
+#undef ROW
+    }
+
+#else
+
+    void Transform::transform_stream_avx2(const VertexStream& /* in */, const TransformedStream& /* out */, size_t /* count */)
+    {
+    }
+
+#endif
+
+}
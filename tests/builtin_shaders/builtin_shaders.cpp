@@ -0,0 +1,138 @@
+#include "render/memory_render_device.h"
+#include "render/shader.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace fbrender;
+
+/*
+ * Every built-in shader has to draw the image of its DS_* mode: a scene of
+ * overlapping cubes, some crossing the edges of the screen, drawn once with
+ * draw_indexed() and once with draw_shaded(), under a normal and a mirrored
+ * projection, with every texture filter and with and without worker threads.
+ * Colors may differ by a step per channel where Gouraud lighting is done
+ * before rather than after clipping.
+ */
+
+static const Vertex CUBE_VERTICES[] = {
+    {  1, -1,  1, 1, 0, 0, 1.0f, 0.2f, 0.2f },
+    { -1, -1,  1, 1, 0, 1, 0.2f, 1.0f, 0.2f },
+    { -1,  1,  1, 1, 1, 1, 0.2f, 0.2f, 1.0f },
+    {  1,  1,  1, 1, 1, 0, 1.0f, 0.2f, 1.0f },
+    {  1, -1, -1, 1, 0, 0, 1.0f, 1.0f, 0.2f },
+    { -1, -1, -1, 1, 0, 1, 0.2f, 1.0f, 1.0f },
+    { -1,  1, -1, 1, 1, 1, 1.0f, 0.3f, 0.3f },
+    {  1,  1, -1, 1, 1, 0, 0.2f, 1.0f, 0.3f },
+};
+
+static const uint32_t CUBE_INDICES[] = {
+    0, 1, 2, 2, 3, 0,
+    7, 6, 5, 5, 4, 7,
+    0, 4, 5, 5, 1, 0,
+    1, 5, 6, 6, 2, 1,
+    2, 6, 7, 7, 3, 2,
+    3, 7, 4, 4, 0, 3,
+};
+
+static const int WIDTH = 320;
+static const int HEIGHT = 240;
+static const int CUBES = 12;
+
+struct TestDevice {
+    std::vector<uint32_t> pixels;
+    MemoryRenderDevice device;
+
+    TestDevice(int threads, bool mirrored, int filter)
+        : pixels(WIDTH * HEIGHT),
+          device(WIDTH, HEIGHT, pixels.data(), WIDTH * sizeof(uint32_t))
+    {
+        std::vector<uint32_t> texels(128 * 128);
+        for (size_t i = 0; i < texels.size(); i++) texels[i] = (((i % 128) / 8 + i / 1024) & 1) ? 0xffe0c0 : 0x3050ff;
+        device.texture_image_2d(128, 128, RenderDevice::CF_RGBA, texels.data());
+        device.set_texture_filter(filter);
+
+        device.set_camera(Vector4(9, 0, 0, 1), Vector4(0, 0, 0, 1), Vector4(0, 0, 1, 1));
+        if (mirrored) device.set_projection(Matrix4::scale(-1, 1, 1) * device.shader_uniforms().projection);
+        device.set_light_pos(Vector4(100, -300, 500, 1));
+        device.set_light_ambient(Color((Real)0.3, (Real)0.3, (Real)0.3));
+        device.set_light_diffuse(Color((Real)0.5, (Real)0.4, (Real)0.3));
+        device.set_material_diffuse(Color((Real)0.2, (Real)0.3, (Real)0.4));
+        device.set_raster_mode(RenderDevice::RM_HALF_SPACE);
+        device.set_worker_threads(threads);
+        device.clear_color(Color(1, 0, 1));
+        device.clear();
+    }
+};
+
+static Matrix4 cube_world(int i)
+{
+    /* spread over and past the screen, the nearest one close to the camera */
+    return Matrix4::rotate(1, (Real)0.3, (Real)0.2, (Real)i * (Real)0.7) *
+           Matrix4::translate((Real)i * (Real)0.9 - 6, (Real)(i % 5) * 2 - 4, (Real)(i % 3) * 2 - 2);
+}
+
+template <class Shader>
+static int compare(const char* name, int state, int threads, bool mirrored, int filter)
+{
+    TestDevice fixed(threads, mirrored, filter), shaded(threads, mirrored, filter);
+
+    fixed.device.enable(state);
+    for (int i = 0; i < CUBES; i++) {
+        fixed.device.set_world(cube_world(i));
+        fixed.device.draw_indexed(CUBE_VERTICES, 8, CUBE_INDICES, 36);
+        shaded.device.set_world(cube_world(i));
+        shaded.device.draw_shaded(Shader(shaded.device.shader_uniforms()), CUBE_VERTICES, 8, CUBE_INDICES, 36);
+    }
+    fixed.device.swap_buffers();
+    shaded.device.swap_buffers();
+
+    long drawn = 0, differ = 0, off = 0;
+    for (size_t i = 0; i < fixed.pixels.size(); i++) {
+        uint32_t a = fixed.pixels[i] & 0xffffff, b = shaded.pixels[i] & 0xffffff;
+        drawn += a != 0xff00ff;
+        if (a == b) continue;
+        differ++;
+        for (int shift = 0; shift < 24; shift += 8) {
+            if (abs((int)((a >> shift) & 0xff) - (int)((b >> shift) & 0xff)) > 1) {
+                off++;
+                break;
+            }
+        }
+    }
+
+    printf("%-22s filter %d threads %d%s: %ld pixels drawn, %ld differ, %ld by more than a step\n",
+           name, filter, threads, mirrored ? " mirrored" : "", drawn, differ, off);
+    return off || drawn == 0 ? 1 : 0;
+}
+
+int main()
+{
+    static const int filters[] = { RenderDevice::TF_NEAREST, RenderDevice::TF_LINEAR,
+                                   RenderDevice::TF_NEAREST_MIPMAP_NEAREST, RenderDevice::TF_LINEAR_MIPMAP_LINEAR };
+    int failures = 0;
+
+    for (int threads = 0; threads <= 4; threads += 4) {
+        for (int mirrored = 0; mirrored < 2; mirrored++) {
+            failures += compare<ColorShader>("ColorShader", RenderDevice::DS_COLOR, threads, mirrored, RenderDevice::TF_NEAREST);
+            failures += compare<LitColorShader>("LitColorShader", RenderDevice::DS_COLOR | RenderDevice::DS_LIGHTING,
+                                                threads, mirrored, RenderDevice::TF_NEAREST);
+            failures += compare<GouraudColorShader>("GouraudColorShader",
+                                                    RenderDevice::DS_COLOR | RenderDevice::DS_LIGHTING_GOURAUD,
+                                                    threads, mirrored, RenderDevice::TF_NEAREST);
+            for (int f = 0; f < 4; f++) {
+                failures += compare<TextureShader>("TextureShader", RenderDevice::DS_TEXTURE_2D, threads, mirrored, filters[f]);
+                failures += compare<LitTextureShader>("LitTextureShader", RenderDevice::DS_TEXTURE_2D | RenderDevice::DS_LIGHTING,
+                                                      threads, mirrored, filters[f]);
+                failures += compare<GouraudTextureShader>("GouraudTextureShader",
+                                                          RenderDevice::DS_TEXTURE_2D | RenderDevice::DS_LIGHTING_GOURAUD,
+                                                          threads, mirrored, filters[f]);
+            }
+        }
+    }
+
+    printf("%s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,123 @@
+#include "render/memory_render_device.h"
+#include "render/command_buffer.h"
+
+#include <cstdio>
+#include <vector>
+
+using namespace fbrender;
+
+/*
+ * A CommandBuffer has to draw the same image as the same calls made directly
+ * on the device: overlapping textured cubes recorded back to front with
+ * alternating textures, and a wireframe cube in the middle that later filled
+ * cubes partly cover.
+ */
+
+static const Vertex CUBE_VERTICES[] = {
+    {  1, -1,  1, 1, 0, 0, 1.0f, 0.2f, 0.2f },
+    { -1, -1,  1, 1, 0, 1, 0.2f, 1.0f, 0.2f },
+    { -1,  1,  1, 1, 1, 1, 0.2f, 0.2f, 1.0f },
+    {  1,  1,  1, 1, 1, 0, 1.0f, 0.2f, 1.0f },
+    {  1, -1, -1, 1, 0, 0, 1.0f, 1.0f, 0.2f },
+    { -1, -1, -1, 1, 0, 1, 0.2f, 1.0f, 1.0f },
+    { -1,  1, -1, 1, 1, 1, 1.0f, 0.3f, 0.3f },
+    {  1,  1, -1, 1, 1, 0, 0.2f, 1.0f, 0.3f },
+};
+
+static const uint32_t CUBE_INDICES[] = {
+    0, 1, 2, 2, 3, 0,
+    7, 6, 5, 5, 4, 7,
+    0, 4, 5, 5, 1, 0,
+    1, 5, 6, 6, 2, 1,
+    2, 6, 7, 7, 3, 2,
+    3, 7, 4, 4, 0, 3,
+};
+
+static const int WIDTH = 320;
+static const int HEIGHT = 240;
+static const int CUBES = 24;
+static const int WIRE_CUBE = CUBES / 2;
+
+/* a device set up identically for both ways of drawing, texture names are the same */
+struct TestDevice {
+    std::vector<uint32_t> pixels;
+    MemoryRenderDevice device;
+    int textures[2];
+
+    TestDevice(int threads)
+        : pixels(WIDTH * HEIGHT),
+          device(WIDTH, HEIGHT, pixels.data(), WIDTH * sizeof(uint32_t))
+    {
+        std::vector<uint32_t> texels(64 * 64);
+        for (int t = 0; t < 2; t++) {
+            for (size_t i = 0; i < texels.size(); i++) texels[i] = (((i % 64) / 8 + i / 512 + t) & 1) ? 0xffffff : 0x4060ff;
+            textures[t] = device.create_texture();
+            device.bind_texture(textures[t]);
+            device.texture_image_2d(64, 64, RenderDevice::CF_RGBA, texels.data());
+        }
+        device.bind_texture(0);
+        device.set_camera(Vector4(20, 0, 0, 1), Vector4(0, 0, 0, 1), Vector4(0, 0, 1, 1));
+        device.set_light_pos(Vector4(100, -300, 500, 1));
+        device.set_light_ambient(Color((Real)0.3, (Real)0.3, (Real)0.3));
+        device.set_raster_mode(RenderDevice::RM_HALF_SPACE);
+        device.set_worker_threads(threads);
+    }
+};
+
+static Matrix4 cube_world(int i)
+{
+    /* from far (x = -10) to near, the camera is at x = 20 */
+    return Matrix4::rotate(1, (Real)0.3, (Real)0.2, (Real)i * (Real)0.4) *
+           Matrix4::translate((Real)i * (Real)0.6 - 10, (Real)(i % 5) - 2, (Real)(i / 5 % 3) - 1);
+}
+
+static int cube_state(int i)
+{
+    return i == WIRE_CUBE ? RenderDevice::DS_WIREFRAME : RenderDevice::DS_TEXTURE_2D | RenderDevice::DS_LIGHTING;
+}
+
+static int run(int threads)
+{
+    TestDevice direct(threads), recorded(threads);
+
+    RenderDevice& d = direct.device;
+    d.clear();
+    for (int i = 0; i < CUBES; i++) {
+        d.disable(RenderDevice::DS_WIREFRAME | RenderDevice::DS_TEXTURE_2D | RenderDevice::DS_LIGHTING);
+        d.enable(cube_state(i));
+        d.set_world(cube_world(i));
+        d.bind_texture(direct.textures[i % 2]);
+        d.draw_indexed(CUBE_VERTICES, 8, CUBE_INDICES, 36);
+    }
+    d.swap_buffers();
+
+    CommandBuffer commands;
+    for (int i = 0; i < CUBES; i++) {
+        commands.disable(RenderDevice::DS_WIREFRAME | RenderDevice::DS_TEXTURE_2D | RenderDevice::DS_LIGHTING);
+        commands.enable(cube_state(i));
+        commands.set_world(cube_world(i));
+        commands.bind_texture(recorded.textures[i % 2]);
+        commands.draw_indexed(CUBE_VERTICES, 8, CUBE_INDICES, 36);
+    }
+
+    /* twice, the second time from the cached order */
+    int failures = 0;
+    for (int frame = 0; frame < 2; frame++) {
+        recorded.device.clear();
+        recorded.device.execute(commands);
+        recorded.device.swap_buffers();
+
+        long differ = 0;
+        for (size_t i = 0; i < direct.pixels.size(); i++) differ += direct.pixels[i] != recorded.pixels[i];
+        printf("threads %d frame %d: %ld pixels differ\n", threads, frame, differ);
+        if (differ) failures++;
+    }
+    return failures;
+}
+
+int main()
+{
+    int failures = run(0) + run(4);
+    printf("%s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
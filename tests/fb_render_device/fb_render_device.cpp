@@ -0,0 +1,246 @@
+#include "render/fb_render_device.h"
+
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+using namespace fbrender;
+
+/*
+ * FBRenderDevice driven against a fake framebuffer: the video memory is a
+ * file, which the device opens and maps like /dev/fb0, and the framebuffer
+ * ioctls on it are answered by the ioctl() below, which takes precedence over
+ * the C library's. Every scenario draws frames of a known color and checks
+ * what the fake driver scans out, before the frame is swapped, when the
+ * previous one must still be on display, and after.
+ */
+
+static const int WIDTH = 72;
+static const int HEIGHT = 40;
+
+/* the fake driver */
+struct FakeFramebuffer {
+    /* the file standing in for the device node */
+    dev_t dev;
+    ino_t ino;
+    struct fb_var_screeninfo var;
+    struct fb_fix_screeninfo fix;
+    /* pans accepted before the driver starts refusing them, -1 for no limit */
+    int pans_left;
+    int pans;
+};
+
+static FakeFramebuffer fake;
+
+extern "C" int ioctl(int fd, unsigned long request, ...)
+{
+    va_list args;
+    va_start(args, request);
+    void* arg = va_arg(args, void*);
+    va_end(args);
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_dev != fake.dev || st.st_ino != fake.ino) {
+        return (int)syscall(SYS_ioctl, fd, request, arg);
+    }
+
+    switch (request) {
+        case FBIOGET_FSCREENINFO:
+            memcpy(arg, &fake.fix, sizeof(fake.fix));
+            return 0;
+        case FBIOGET_VSCREENINFO:
+            memcpy(arg, &fake.var, sizeof(fake.var));
+            return 0;
+        case FBIOPUT_VSCREENINFO: {
+            /* the resolution is fixed, the virtual height is cut to the memory */
+            struct fb_var_screeninfo v = *(struct fb_var_screeninfo*)arg;
+            unsigned int rows = fake.fix.smem_len / fake.fix.line_length;
+            fake.var.yres_virtual = v.yres_virtual < fake.var.yres ? fake.var.yres :
+                                    v.yres_virtual > rows ? rows : v.yres_virtual;
+            fake.var.yoffset = 0;
+            return 0;
+        }
+        case FBIOPAN_DISPLAY: {
+            const struct fb_var_screeninfo* v = (const struct fb_var_screeninfo*)arg;
+            if (fake.pans_left == 0 || v->yoffset + fake.var.yres > fake.var.yres_virtual) {
+                errno = EINVAL;
+                return -1;
+            }
+            if (fake.pans_left > 0) fake.pans_left--;
+            fake.var.yoffset = v->yoffset;
+            fake.pans++;
+            return 0;
+        }
+    }
+    errno = ENOTTY;
+    return -1;
+}
+
+struct Scenario {
+    const char* name;
+    int mode;
+    int bits_per_pixel;
+    /* pages of video memory */
+    int pages;
+    int pans_left;
+    int expected_mode;
+    /* the present mode once all frames are drawn */
+    int final_mode;
+};
+
+static void set_format(struct fb_var_screeninfo& v, int bits_per_pixel)
+{
+    v.bits_per_pixel = bits_per_pixel;
+    if (bits_per_pixel == 16) {
+        v.red.offset = 11; v.red.length = 5;
+        v.green.offset = 5; v.green.length = 6;
+        v.blue.offset = 0; v.blue.length = 5;
+    } else {
+        v.red.offset = 16; v.red.length = 8;
+        v.green.offset = 8; v.green.length = 8;
+        v.blue.offset = 0; v.blue.length = 8;
+    }
+}
+
+/* the pixel at (x, y) of the page on display, widened to XRGB8888 */
+static uint32_t scanned_out(const char* memory, int bits_per_pixel, int x, int y)
+{
+    const char* row = memory + (fake.var.yoffset + y) * fake.fix.line_length;
+    if (bits_per_pixel == 32) return ((const uint32_t*)row)[x] & 0xffffff;
+
+    uint16_t p = ((const uint16_t*)row)[x];
+    return ((p >> 11) << 19) | (((p >> 5) & 0x3f) << 10) | ((p & 0x1f) << 3);
+}
+
+static const Color colors[] = { Color(1, 0, 0), Color(0, 1, 0), Color(0, 0, 1), Color(1, 1, 1) };
+
+/* the pixels on display that differ from frame */
+static int wrong_pixels(const char* memory, int bits_per_pixel, int frame)
+{
+    uint32_t expected = colors[frame % 4].color_value();
+    int wrong = 0;
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            uint32_t want = x == frame && y == frame ? 0 : expected;
+            if (bits_per_pixel == 16) want &= 0xf8fcf8;
+            wrong += scanned_out(memory, bits_per_pixel, x, y) != want;
+        }
+    }
+    return wrong;
+}
+
+static int run(const Scenario& s, const char* path)
+{
+    int bytes_per_pixel = s.bits_per_pixel / 8;
+    /* rows are padded, as drivers do */
+    fake.fix = fb_fix_screeninfo();
+    fake.fix.line_length = (WIDTH + 8) * bytes_per_pixel;
+    fake.fix.smem_len = fake.fix.line_length * HEIGHT * s.pages;
+    fake.var = fb_var_screeninfo();
+    fake.var.xres = fake.var.xres_virtual = WIDTH;
+    fake.var.yres = fake.var.yres_virtual = HEIGHT;
+    set_format(fake.var, s.bits_per_pixel);
+    fake.pans_left = s.pans_left;
+    fake.pans = 0;
+
+    int fd = open(path, O_RDWR | O_TRUNC);
+    struct stat st;
+    if (fd < 0 || ftruncate(fd, fake.fix.smem_len) || fstat(fd, &st)) {
+        perror(path);
+        return 1;
+    }
+    fake.dev = st.st_dev;
+    fake.ino = st.st_ino;
+    const char* memory = (const char*)mmap(0, fake.fix.smem_len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    int failures = 0;
+    {
+        FBRenderDevice device(path, s.mode);
+        if (!device.ready()) {
+            printf("%s: device not ready\n", s.name);
+            failures++;
+        } else {
+            if (device.get_present_mode() != s.expected_mode) {
+                printf("%s: present mode %d, expected %d\n", s.name, device.get_present_mode(), s.expected_mode);
+                failures++;
+            }
+
+            for (int frame = 0; frame < 6; frame++) {
+                device.clear_color(colors[frame % 4]);
+                device.clear();
+                device.draw_pixel(frame, frame, 0x000000);
+                device.flush();
+
+                /* nothing of a frame shows before it is swapped */
+                int wrong = frame > 0 ? wrong_pixels(memory, s.bits_per_pixel, frame - 1) : 0;
+                if (wrong) {
+                    printf("%s: frame %d shows %d pixels before it is swapped\n", s.name, frame, wrong);
+                    failures++;
+                }
+
+                device.swap_buffers();
+
+                wrong = wrong_pixels(memory, s.bits_per_pixel, frame);
+                if (wrong) {
+                    printf("%s: frame %d has %d wrong pixels on display\n", s.name, frame, wrong);
+                    failures++;
+                }
+            }
+
+            if (device.get_present_mode() != s.final_mode) {
+                printf("%s: present mode %d after the frames, expected %d\n", s.name, device.get_present_mode(), s.final_mode);
+                failures++;
+            }
+        }
+    }
+
+    /* a device that flipped leaves the screen as it found it */
+    if (fake.var.yres_virtual != HEIGHT) {
+        printf("%s: virtual height %u not restored\n", s.name, fake.var.yres_virtual);
+        failures++;
+    }
+
+    printf("%s: %d pans, %s\n", s.name, fake.pans, failures ? "FAILED" : "passed");
+    munmap((void*)memory, fake.fix.smem_len);
+    return failures;
+}
+
+int main()
+{
+    char path[] = "/tmp/fbrender_fb_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    static const Scenario scenarios[] = {
+        { "copy", FBRenderDevice::PM_COPY, 32, 2, -1, FBRenderDevice::PM_COPY, FBRenderDevice::PM_COPY },
+        { "copy rgb565", FBRenderDevice::PM_COPY, 16, 1, -1, FBRenderDevice::PM_COPY, FBRenderDevice::PM_COPY },
+        { "flip", FBRenderDevice::PM_FLIP, 32, 2, -1, FBRenderDevice::PM_FLIP, FBRenderDevice::PM_FLIP },
+        { "flip refused pan", FBRenderDevice::PM_FLIP, 32, 2, 0, FBRenderDevice::PM_COPY, FBRenderDevice::PM_COPY },
+        { "flip single page", FBRenderDevice::PM_FLIP, 32, 1, -1, FBRenderDevice::PM_COPY, FBRenderDevice::PM_COPY },
+        { "flip rgb565", FBRenderDevice::PM_FLIP, 16, 2, -1, FBRenderDevice::PM_COPY, FBRenderDevice::PM_COPY },
+        /* the pan done when flipping is enabled and two frames, then none: the
+         * third frame is copied and the device falls back to PM_COPY */
+        { "flip pans stop", FBRenderDevice::PM_FLIP, 32, 2, 3, FBRenderDevice::PM_FLIP, FBRenderDevice::PM_COPY },
+        /* the same with the fallback onto the second page */
+        { "flip pans stop on page 1", FBRenderDevice::PM_FLIP, 32, 2, 2, FBRenderDevice::PM_FLIP, FBRenderDevice::PM_COPY },
+    };
+
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) failures += run(scenarios[i], path);
+
+    unlink(path);
+    printf("%s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
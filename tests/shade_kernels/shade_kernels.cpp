@@ -0,0 +1,154 @@
+#include "render/render_device.h"
+#include "render/shading.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace fbrender;
+
+/*
+ * Every SIMD shading kernel has to shade like the scalar kernel of its color
+ * path: the same pixels pass the depth test and get the same depth, and colors
+ * differ by at most one step per channel. Random segments and states are shaded
+ * by both for the feature set of every drawing state the SIMD kernels take.
+ */
+
+static const int SEGMENTS = 2000;
+static const int MAX_PIXELS = 41;
+
+static Real random_real(Real lo, Real hi)
+{
+    return lo + (hi - lo) * (Real)rand() / (Real)RAND_MAX;
+}
+
+static Color random_color()
+{
+    return Color(random_real(0, 1), random_real(0, 1), random_real(0, 1));
+}
+
+static int channel_diff(uint32_t a, uint32_t b, int shift)
+{
+    return abs((int)((a >> shift) & 0xff) - (int)((b >> shift) & 0xff));
+}
+
+/* the number of segments the kernel shaded differently from the reference */
+static int compare_kernels(ShadeKernel reference, ShadeKernel kernel, int features, const Texture& texture)
+{
+    int failures = 0;
+
+    for (int n = 0; n < SEGMENTS; n++) {
+        ShadingState st = ShadingState();
+        st.texture = &texture;
+        st.light_world_pos = Vector4(random_real(-10, 10), random_real(-10, 10), random_real(-10, 10));
+        st.ambient_color = random_color() * (Real)0.5;
+        st.diffuse_color = random_color();
+        st.material_diffuse = random_color() * (Real)0.5;
+
+        Real start[ATTR_COUNT], step[ATTR_COUNT];
+        start[ATTR_INVW] = random_real((Real)0.05, 1);
+        step[ATTR_INVW] = random_real((Real)-0.01, (Real)0.01);
+        for (int a = ATTR_U; a <= ATTR_B; a++) {
+            start[a] = random_real((Real)-0.2, (Real)1.2);
+            step[a] = random_real((Real)-0.05, (Real)0.05);
+        }
+        for (int a = ATTR_WX; a <= ATTR_WZ; a++) {
+            start[a] = random_real(-10, 10);
+            step[a] = random_real((Real)-0.5, (Real)0.5);
+        }
+        for (int a = ATTR_NX; a <= ATTR_NZ; a++) {
+            start[a] = random_real(-1, 1);
+            step[a] = random_real((Real)-0.05, (Real)0.05);
+        }
+
+        SpanSegment seg = SpanSegment();
+        seg.count = 1 + rand() % MAX_PIXELS;
+        seg.first = rand() % seg.count;
+        seg.start = start;
+        seg.step = step;
+        seg.depth_test = rand() % 4 != 0;
+
+        Real depth[2][MAX_PIXELS];
+        uint32_t color[2][MAX_PIXELS];
+        for (int i = 0; i < seg.count; i++) {
+            depth[0][i] = depth[1][i] = random_real(0, 1);
+            color[0][i] = color[1][i] = (uint32_t)rand() & 0xffffff;
+        }
+
+        seg.depth = depth[0];
+        seg.color = color[0];
+        int expected = reference(seg, st);
+        seg.depth = depth[1];
+        seg.color = color[1];
+        int written = kernel(seg, st);
+
+        bool same = written == expected;
+        for (int i = 0; i < seg.count; i++) {
+            same = same && depth[0][i] == depth[1][i];
+            same = same && channel_diff(color[0][i], color[1][i], 16) <= 1 &&
+                   channel_diff(color[0][i], color[1][i], 8) <= 1 &&
+                   channel_diff(color[0][i], color[1][i], 0) <= 1;
+        }
+        if (!same) failures++;
+    }
+
+    if (failures) printf("features 0x%x: %d of %d segments differ\n", features, failures, SEGMENTS);
+    return failures;
+}
+
+int main()
+{
+    const int size = 16;
+    std::vector<uint32_t> texels(size * size);
+    for (size_t i = 0; i < texels.size(); i++) texels[i] = (uint32_t)rand() & 0xffffff;
+
+    Texture texture = Texture();
+    texture.width = texture.height = size;
+    texture.level_count = 1;
+    texture.levels[0] = texels.data();
+
+    static const int levels[] = { SIMD_SSE41, SIMD_AVX2 };
+    static const char* level_names[] = { "sse4.1", "avx2" };
+    static const int paths[] = { RenderDevice::CP_FLOAT, RenderDevice::CP_FIXED };
+    static const char* path_names[] = { "float", "fixed" };
+
+    /* the feature sets drawing states map to, filtered textures are only shaded by the scalar kernel */
+    static const int state_bits[] = { RenderDevice::DS_COLOR, RenderDevice::DS_TEXTURE_2D,
+                                      RenderDevice::DS_LIGHTING, RenderDevice::DS_LIGHTING_GOURAUD };
+    std::vector<int> feature_sets;
+    for (int combination = 0; combination < 16; combination++) {
+        ShadingState st = ShadingState();
+        st.texture = &texture;
+        st.tex_filter = RenderDevice::TF_NEAREST;
+        for (int b = 0; b < 4; b++) {
+            if (combination & (1 << b)) st.drawing_state |= state_bits[b];
+        }
+        int features = shade_features(st);
+        if (std::find(feature_sets.begin(), feature_sets.end(), features) == feature_sets.end()) {
+            feature_sets.push_back(features);
+        }
+    }
+
+    int failures = 0;
+    for (int l = 0; l < 2; l++) {
+        if (detect_simd_level() < levels[l]) {
+            printf("%s: not supported, skipped\n", level_names[l]);
+            continue;
+        }
+        for (int p = 0; p < 2; p++) {
+            int differ = 0;
+            for (size_t f = 0; f < feature_sets.size(); f++) {
+                int features = feature_sets[f];
+                ShadeKernel reference = select_shade_kernel(SIMD_NONE, paths[p], features);
+                ShadeKernel kernel = select_shade_kernel(levels[l], paths[p], features);
+                differ += compare_kernels(reference, kernel, features, texture);
+            }
+            printf("%s %s: %d segments differ\n", level_names[l], path_names[p], differ);
+            failures += differ;
+        }
+    }
+
+    printf("%s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}